@@ -22,15 +22,17 @@ the application command line. It then attaches the debugger and runs the
 actual app.
 """
 
-import logging
 import os
 import sys
+import threading
 
-import appengine_pretty_printers
-import breakpoints_manager
-import capture_collector
 import cdbg_native
-import gcp_hub_client
+
+# The rest of the debugger modules are imported when the debugger starts.
+# This keeps "import googleclouddebugger" cheap and allows the background
+# startup mode to move the expensive imports (API client library) off the
+# application startup path.
+# pylint: disable=g-import-not-at-top
 
 # Versioning scheme: MAJOR.MINOR
 # The major version should only change on breaking changes. Minor version
@@ -39,39 +41,192 @@ import gcp_hub_client
 __version__ = '1.9'
 
 _flags = None
+_hub_client = None
+_breakpoints_manager = None
+_local_control_server = None
+
+# Process ID in which the background startup thread was started or None if
+# the debugger components were started synchronously.
+_background_startup_pid = None
+
+# Original os.fork function if the fork hook is installed or None otherwise.
+_real_fork = None
 
 
 def _StartDebugger():
-  global _hub_client
-  global _breakpoints_manager
+  """Configures and starts the debugger.
+
+  Only the native module is initialized inline. With "background_startup"
+  flag, everything else (imports of the API client library, metadata
+  queries, creation of the debugger components) happens on a background
+  thread, so that the debugger doesn't delay the application startup. The
+  uniquifier computation and debuggee registration always run on the hub
+  client worker thread.
+  """
+  global _background_startup_pid
 
   cdbg_native.InitializeModule(_flags)
+  _InstallForkHook()
 
-  _hub_client = gcp_hub_client.GcpHubClient()
-  _breakpoints_manager = breakpoints_manager.BreakpointsManager(_hub_client)
+  if _flags.get('background_startup') in ('1', 'true', True):
+    _background_startup_pid = os.getpid()
+    _StartComponentsInBackground()
+  else:
+    _StartComponents()
+
+
+def _StartComponentsInBackground():
+  """Runs _StartComponents on a background thread."""
+  thread = threading.Thread(target=_StartComponents)
+  thread.name = 'Cloud Debugger startup'
+  thread.daemon = True
+  thread.start()
+
+
+def _StartComponents():
+  """Creates and starts the hub client and the breakpoints manager."""
+  global _hub_client
+  global _breakpoints_manager
+  global _local_control_server
+
+  import logging
+  import appengine_pretty_printers
+  import breakpoints_manager
+  import capture_collector
+  import hub_coordinator
+  import local_control
+  import module_catalog
+
+  if _flags.get('hub_coordinator_socket'):
+    hub_client = hub_coordinator.HubCoordinatorClient(
+        _flags['hub_coordinator_socket'],
+        _CreateHubClient)
+  else:
+    hub_client = _CreateHubClient()
+  _breakpoints_manager = breakpoints_manager.BreakpointsManager(hub_client)
+  _breakpoints_manager.max_memory_bytes = int(
+      _flags.get('max_agent_memory_bytes', 0))
 
   # Set up loggers for logpoints.
   capture_collector.log_info_message = logging.info
   capture_collector.log_warning_message = logging.warning
   capture_collector.log_error_message = logging.error
 
-  """Configures and starts the debugger."""
-  capture_collector.CaptureCollector.pretty_printers.append(
-      appengine_pretty_printers.PrettyPrinter)
+  appengine_pretty_printers.RegisterPrettyPrinters(
+      capture_collector.RegisterPrettyPrinter)
 
-  _hub_client.on_active_breakpoints_changed = (
+  hub_client.on_active_breakpoints_changed = (
       _breakpoints_manager.SetActiveBreakpoints)
-  _hub_client.on_idle = _breakpoints_manager.CheckBreakpointsExpiration
+  hub_client.on_idle = _breakpoints_manager.CheckBreakpointsExpiration
+  _hub_client = hub_client
+  _hub_client.Start()
+
+  # Deferred breakpoints look up module names in the catalog. Building it
+  # takes a while, so start it before the first deferred breakpoint arrives.
+  module_catalog.StartBackgroundScan()
+
+  if _flags.get('local_control_socket'):
+    _local_control_server = local_control.LocalControlServer(
+        _flags['local_control_socket'],
+        _breakpoints_manager)
+    _local_control_server.Start()
+
+
+def _CreateHubClient():
+  """Creates the client of the debugger backend configured from flags."""
+  import gcp_hub_client
+  import transmission_spool
+
+  hub_client = gcp_hub_client.GcpHubClient()
+
   if _flags.get('enable_service_account_auth') in ('1', 'true', True):
-    _hub_client.EnableServiceAccountAuth(
+    hub_client.EnableServiceAccountAuth(
         _flags['project_id'],
         _flags['project_number'],
         _flags['service_account_email'],
         _flags['service_account_p12_file'])
   else:
-    _hub_client.EnableGceAuth()
-  _hub_client.InitializeDebuggeeLabels(_flags)
-  _hub_client.Start()
+    hub_client.EnableGceAuth()
+  if _flags.get('transmission_spool_path'):
+    hub_client.EnableTransmissionSpool(
+        _flags['transmission_spool_path'],
+        int(_flags.get('transmission_spool_size',
+                       transmission_spool.DEFAULT_MAX_SIZE)))
+  if _flags.get('upload_compression'):
+    hub_client.EnableUploadCompression(
+        _flags['upload_compression'],
+        int(_flags.get('upload_compression_min_size',
+                       gcp_hub_client.DEFAULT_UPLOAD_COMPRESSION_MIN_SIZE)))
+  hub_client.InitializeDebuggeeLabels(_flags)
+
+  return hub_client
+
+
+def _InstallForkHook():
+  """Wraps os.fork to reinitialize the debugger in child processes."""
+  global _real_fork
+
+  if _real_fork:
+    return  # Fork hook already installed
+
+  _real_fork = os.fork
+
+  def _ForkHook():
+    pid = _real_fork()
+    if pid == 0:
+      AfterFork()
+    return pid
+
+  os.fork = _ForkHook
+
+
+def AfterFork():
+  """Reinitializes the debugger in a forked child process.
+
+  Background threads don't survive fork, so they are restarted. Everything
+  else is carried into the child process: the registered debuggee, active
+  breakpoints and the patched code. The child is therefore debuggable right
+  away, without walking modules or registering the debuggee again.
+
+  This function is called automatically when the process forks with
+  os.fork. Servers that fork outside of Python (for example uwsgi) should
+  call it from their post-fork hook. Calling it in a process that hasn't
+  forked is a no-op.
+  """
+  global _background_startup_pid
+
+  if _hub_client is None:
+    if _background_startup_pid not in (None, os.getpid()):
+      # The process forked before the background startup completed.
+      _background_startup_pid = os.getpid()
+      _StartComponentsInBackground()
+    return
+
+  _breakpoints_manager.AfterFork()
+  _hub_client.AfterFork()
+  if _local_control_server is not None:
+    _local_control_server.AfterFork()
+
+
+def SetRequestTag(tag):
+  """Tags the request handled by the current thread.
+
+  Breakpoints with a "requestTag" field only fire on threads that have the
+  same tag. This lets a snapshot target a single customer or trace without a
+  condition evaluated on every request. Checking the tag is a pointer or
+  integer comparison, so untagged requests are not slowed down.
+
+  The tag stays set until it is changed or cleared, so request handlers
+  should clear it when they are done.
+
+  Args:
+    tag: string or integer identifying the request, or None to clear the
+        tag.
+
+  Raises:
+    TypeError: if the tag is neither string nor integer.
+  """
+  cdbg_native.SetRequestTag(tag)
 
 
 def _DebuggerMain():
@@ -27,3 +27,13 @@ def PrettyPrinter(obj):
     return obj.to_dict().iteritems(), 'ndb.Model(%s)' % type(obj).__name__
 
   return None
+
+
+def RegisterPrettyPrinters(register):
+  """Registers the pretty printers for the types that are available.
+
+  Args:
+    register: callable taking the type and its pretty printer.
+  """
+  if ndb:
+    register(ndb.Model, PrettyPrinter)
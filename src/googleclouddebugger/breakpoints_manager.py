@@ -14,10 +14,26 @@
 
 """Manages lifetime of individual breakpoint objects."""
 
+from collections import deque
 from datetime import datetime
+import os
 from threading import RLock
+import time
 
+import cdbg_native as native
+import capture_collector
+import diagnostic_actions
+import module_explorer
+import module_lookup
 import python_breakpoint
+import timer_queue
+
+# Activation of new breakpoints yields Interpreter Lock to the application
+# threads after running for this long.
+_ACTIVATION_TIME_SLICE_SEC = 0.005
+
+# Duration of the pause between time slices of breakpoint activation.
+_ACTIVATION_YIELD_SEC = 0.0005
 
 
 class BreakpointsManager(object):
@@ -29,7 +45,14 @@ class BreakpointsManager(object):
   corresponding to new breakpoints and removes breakpoints that are no
   longer active.
 
-  This class is thread safe.
+  New breakpoints are activated after the lock is released, in stages that
+  batch the work of all the new breakpoints (see _ActivateBreakpoints).
+
+  This class is thread safe. The map of active breakpoints is copy-on-write:
+  writers build a new version under the lock and publish it with a single
+  assignment, so readers (GetActiveBreakpoints) never take the lock.
+  Breakpoint hit threads don't take the lock either: completions are queued
+  and processed by the thread that updates the active breakpoints.
 
   Args:
     hub_client: queries active breakpoints from the backend and sends
@@ -38,8 +61,9 @@ class BreakpointsManager(object):
 
   def __init__(self, hub_client):
     self._hub_client = hub_client
+    self._pid = os.getpid()
 
-    # Lock to synchronize access to data across multiple threads.
+    # Lock to synchronize writers across multiple threads.
     self._lock = RLock()
 
     # After the breakpoint completes, it is removed from list of active
@@ -49,11 +73,53 @@ class BreakpointsManager(object):
     # of completed breakpoint IDs.
     self._completed = set()
 
-    # Map of active breakpoints. The key is breakpoint ID.
+    # Map of active breakpoints. The key is breakpoint ID. The published map
+    # is never modified. Writers replace it with an updated copy.
     self._active = {}
 
-    # Closest expiration of all active breakpoints or past time if not known.
-    self._next_expiration = datetime.max
+    # IDs of breakpoints completed by breakpoint hit threads that haven't been
+    # processed yet. deque.append is atomic, so no lock is needed to queue.
+    self._pending_completions = deque()
+
+    # IDs of active breakpoints that were set locally rather than by the
+    # backend (see local_control.py). These are not affected by the list of
+    # active breakpoints that comes from the backend.
+    self._local = set()
+
+    # Expiration timers of active breakpoints and other scheduled work. The
+    # timers run on the thread calling CheckBreakpointsExpiration.
+    self._timers = timer_queue.TimerQueue()
+
+    # Map of active breakpoint IDs to their expiration timers.
+    self._expiration_timers = {}
+
+    # Approximate memory limit of the debugger in bytes (0 if unlimited). See
+    # IsMemoryLimitExceeded.
+    self.max_memory_bytes = 0
+
+    # True if the last check found the debugger over the memory limit. Used
+    # to only log when the state changes.
+    self._memory_limit_exceeded = False
+
+  def AfterFork(self):
+    """Reinitializes the lock in a forked child process.
+
+    The lock might have been held by a thread that doesn't exist in the child
+    process. Active breakpoints are inherited from the parent process as is.
+    """
+    if self._pid == os.getpid():
+      return  # Not a forked process or already reinitialized.
+
+    self._pid = os.getpid()
+    self._lock = RLock()
+    self._timers.AfterFork()
+
+  def GetActiveBreakpoints(self):
+    """Returns the current map of active breakpoints without locking.
+
+    The returned dictionary is a snapshot that must not be modified.
+    """
+    return self._active
 
   def SetActiveBreakpoints(self, breakpoints_data):
     """Adds new breakpoints and removes missing ones.
@@ -61,19 +127,31 @@ class BreakpointsManager(object):
     Args:
       breakpoints_data: updated list of active breakpoints.
     """
+    start_time = time.time()
+    new_breakpoints = []
+
     with self._lock:
+      active = dict(self._active)
+      self._ProcessPendingCompletions(active)
+
       ids = set([x['id'] for x in breakpoints_data])
 
       # Clear breakpoints that no longer show up in active breakpoints list.
-      for breakpoint_id in self._active.viewkeys() - ids:
-        self._active.pop(breakpoint_id).Clear()
+      for breakpoint_id in active.viewkeys() - ids - self._local:
+        self._RemoveBreakpoint(active, breakpoint_id)
 
-      # Create new breakpoints.
-      self._active.update([
-          (x['id'],
-           python_breakpoint.PythonBreakpoint(x, self._hub_client, self))
-          for x in breakpoints_data
-          if x['id'] in ids - self._active.viewkeys() - self._completed])
+      # Create new breakpoints. The memory limit is checked once for the
+      # whole batch: the check is linear in the number of active breakpoints,
+      # so checking it for each new breakpoint would be quadratic.
+      memory_limit_exceeded = None
+      for x in breakpoints_data:
+        if x['id'] not in active and x['id'] not in self._completed:
+          if memory_limit_exceeded is None:
+            memory_limit_exceeded = self.IsMemoryLimitExceeded()
+          breakpoint = self._CreateBreakpoint(
+              x, self._hub_client, memory_limit_exceeded)
+          if self._AddBreakpoint(active, breakpoint):
+            new_breakpoints.append(breakpoint)
 
       # Remove entries from completed_breakpoints_ that weren't listed in
       # breakpoints_data vector. These are confirmed to have been removed by the
@@ -81,42 +159,304 @@ class BreakpointsManager(object):
       # again. The backend never reuses breakpoint IDs.
       self._completed &= ids
 
-      if self._active:
-        self._next_expiration = datetime.min  # Not known.
-      else:
-        self._next_expiration = datetime.max  # Nothing to expire.
+      self._active = active
+
+    self._ActivateBreakpoints(new_breakpoints, start_time)
+
+  def SetLocalBreakpoint(self, definition, hub_client):
+    """Sets a breakpoint that doesn't come from the backend.
+
+    Args:
+      definition: breakpoint definition. Must have a unique ID that the
+          backend doesn't use.
+      hub_client: receives updates of this breakpoint instead of the hub
+          client of this class.
+
+    Returns:
+      False if a breakpoint with the same ID is already active.
+    """
+    start_time = time.time()
+    breakpoint_id = definition['id']
+    with self._lock:
+      if breakpoint_id in self._active:
+        return False
+
+      active = dict(self._active)
+      breakpoint = self._CreateBreakpoint(
+          definition, hub_client, self.IsMemoryLimitExceeded())
+      added = self._AddBreakpoint(active, breakpoint)
+      if added:
+        self._local.add(breakpoint_id)
+
+      self._active = active
+
+    if added:
+      self._ActivateBreakpoints([breakpoint], start_time)
+
+    return True
+
+  def ClearLocalBreakpoint(self, breakpoint_id):
+    """Clears a breakpoint previously set with SetLocalBreakpoint."""
+    with self._lock:
+      if breakpoint_id in self._local:
+        active = dict(self._active)
+        self._local.remove(breakpoint_id)
+        self._RemoveBreakpoint(active, breakpoint_id)
+        self._active = active
 
   def CompleteBreakpoint(self, breakpoint_id):
     """Marks the specified breaking as completed.
 
-    Appends the ID to set of completed breakpoints and clears it.
+    This function is called from breakpoint hit threads. It only queues the
+    breakpoint ID, so that a burst of completions doesn't contend with the
+    hub thread. The caller clears the breakpoint itself. The ID is moved to
+    the set of completed breakpoints before the next reconciliation with the
+    backend list (or on the next expiration check).
 
     Args:
       breakpoint_id: breakpoint ID to complete.
     """
-    with self._lock:
-      self._completed.add(breakpoint_id)
-      if breakpoint_id in self._active:
-        self._active.pop(breakpoint_id).Clear()
+    self._pending_completions.append(breakpoint_id)
 
   def CheckBreakpointsExpiration(self):
-    """Completes all breakpoints that have been active for too long."""
-    with self._lock:
-      current_time = BreakpointsManager._GetCurrentTime()
-      if self._next_expiration > current_time:
+    """Completes breakpoints that have been active for too long.
+
+    This also runs all the other expired timers (see ScheduleTimer).
+    """
+    if self._pending_completions:
+      with self._lock:
+        active = dict(self._active)
+        self._ProcessPendingCompletions(active)
+        self._active = active
+
+    current_time = BreakpointsManager._GetCurrentTime()
+    for callback in self._timers.PopExpired(current_time):
+      callback()
+
+    # Release caches and pending updates early rather than wait for the next
+    # breakpoint.
+    self.IsMemoryLimitExceeded()
+
+  def GetMemoryStats(self):
+    """Approximates memory used by the debugger.
+
+    Memory that is only used for the duration of a single capture (like the
+    snapshot being collected) is not included. Its size is limited by the
+    capture limits.
+
+    Returns:
+      Dictionary mapping subsystem name to the number of bytes it uses.
+    """
+    stats = native.GetMemoryStats()
+    stats['transmission_queue'] = self._hub_client.GetMemoryUsage()
+    return stats
+
+  def IsMemoryLimitExceeded(self):
+    """Checks the memory limit, releasing memory if the limit is reached.
+
+    When the limit is reached, the caches are cleared first, then pending
+    non-final breakpoint updates are dropped (or spooled). If the debugger
+    is still over the limit, new breakpoints should be rejected. Memory of
+    active breakpoints is never released here.
+
+    Returns:
+      True if the debugger is over the memory limit even after releasing
+      memory.
+    """
+    if not self.max_memory_bytes:
+      return False
+
+    exceeded = sum(self.GetMemoryStats().itervalues()) > self.max_memory_bytes
+    if exceeded:
+      capture_collector.ClearCaches()
+      self._hub_client.ReleaseMemory()
+
+      stats = self.GetMemoryStats()
+      exceeded = sum(stats.itervalues()) > self.max_memory_bytes
+      if exceeded and not self._memory_limit_exceeded:
+        native.LogWarning(
+            'Debugger memory limit of %d bytes exceeded, new breakpoints will '
+            'be rejected: %s' % (self.max_memory_bytes, stats))
+
+    if not exceeded and self._memory_limit_exceeded:
+      native.LogInfo('Debugger memory is back under the limit')
+
+    self._memory_limit_exceeded = exceeded
+    return exceeded
+
+  def ScheduleTimer(self, delay, callback, periodic=False):
+    """Schedules a callback on the thread checking breakpoints expiration.
+
+    Args:
+      delay: timedelta after which the callback is invoked.
+      callback: callable to invoke (with no arguments).
+      periodic: if True, the callback is invoked every "delay" until the
+          timer is cancelled.
+
+    Returns:
+      Timer object that can be passed to CancelTimer.
+    """
+    return self._timers.Schedule(
+        BreakpointsManager._GetCurrentTime() + delay,
+        callback,
+        delay if periodic else None)
+
+  def CancelTimer(self, timer):
+    """Cancels a timer previously scheduled with ScheduleTimer."""
+    self._timers.Cancel(timer)
+
+  def _CreateBreakpoint(self, definition, hub_client, memory_limit_exceeded):
+    """Creates a source breakpoint or a diagnostic action.
+
+    Args:
+      definition: breakpoint definition.
+      hub_client: receives updates of the breakpoint.
+      memory_limit_exceeded: result of IsMemoryLimitExceeded. Source
+          breakpoints fail right away if it is True.
+
+    Returns:
+      New breakpoint object.
+    """
+    if diagnostic_actions.IsDiagnosticAction(definition):
+      return diagnostic_actions.CreateDiagnosticAction(
+          definition, hub_client, self)
+
+    return python_breakpoint.PythonBreakpoint(
+        definition, hub_client, self, memory_limit_exceeded)
+
+  def _ActivateBreakpoints(self, breakpoints, start_time):
+    """Sets new source breakpoints. Must be called without the lock.
+
+    Activation goes through three stages, each for all the breakpoints
+    before the next one:
+      1. Resolve: finds the loaded modules for all the paths in a single pass
+         and explores each module once to find the code objects of all its
+         breakpoints. Breakpoints in modules that haven't been loaded yet are
+         deferred.
+      2. Compile: compiles the breakpoint conditions.
+      3. Patch: sets the breakpoints in the bytecode.
+    Breakpoints completed or removed in the meantime drop out of the
+    pipeline. The work pauses every _ACTIVATION_TIME_SLICE_SEC, so that the
+    application threads don't wait on Interpreter Lock for long.
+
+    Args:
+      breakpoints: newly created breakpoints. Diagnostic actions are
+          skipped, since they start when created.
+      start_time: time when the breakpoints were received.
+    """
+    breakpoints = [
+        breakpoint for breakpoint in breakpoints
+        if isinstance(breakpoint, python_breakpoint.PythonBreakpoint)]
+    if not breakpoints:
+      return
+
+    slice_start_time = [time.time()]
+
+    def YieldIfSliceExpired():
+      if time.time() - slice_start_time[0] >= _ACTIVATION_TIME_SLICE_SEC:
+        time.sleep(_ACTIVATION_YIELD_SEC)
+        slice_start_time[0] = time.time()
+
+    # Resolve.
+    resolve_start_time = time.time()
+    modules = module_lookup.FindModules(
+        [breakpoint.definition['location']['path']
+         for breakpoint in breakpoints])
+
+    module_breakpoints = {}
+    for breakpoint in breakpoints:
+      module = modules[breakpoint.definition['location']['path']]
+      if module is None:
+        breakpoint.Resolve(None, None)
+      else:
+        module_breakpoints.setdefault(module, []).append(breakpoint)
+
+    resolved = []
+    for module, group in module_breakpoints.iteritems():
+      code_objects = module_explorer.GetCodeObjectsAtLines(
+          module,
+          [breakpoint.definition['location']['line'] for breakpoint in group])
+      for breakpoint in group:
+        line = breakpoint.definition['location']['line']
+        if breakpoint.Resolve(module, code_objects[line]):
+          resolved.append(breakpoint)
+      YieldIfSliceExpired()
+
+    # Compile.
+    compile_start_time = time.time()
+    compiled = []
+    for breakpoint in resolved:
+      if breakpoint.Compile():
+        compiled.append(breakpoint)
+      YieldIfSliceExpired()
+
+    # Patch.
+    patch_start_time = time.time()
+    activated_count = 0
+    for breakpoint in compiled:
+      if breakpoint.Patch():
+        activated_count += 1
+        native.LogInfo('Breakpoint %s activated in %f ms' % (
+            breakpoint.GetBreakpointId(), (time.time() - start_time) * 1000))
+      YieldIfSliceExpired()
+
+    end_time = time.time()
+    native.LogInfo(
+        ('Activated %d of %d new breakpoints in %f ms (resolve: %f ms, '
+         'compile: %f ms, patch: %f ms)') % (
+             activated_count,
+             len(breakpoints),
+             (end_time - start_time) * 1000,
+             (compile_start_time - resolve_start_time) * 1000,
+             (patch_start_time - compile_start_time) * 1000,
+             (end_time - patch_start_time) * 1000))
+
+  def _AddBreakpoint(self, active, breakpoint):
+    """Starts tracking a new breakpoint. Must be called with the lock held.
+
+    Args:
+      active: new version of the active breakpoints map to update.
+      breakpoint: newly created PythonBreakpoint object.
+
+    Returns:
+      False if the breakpoint has already completed (for example due to an
+      invalid source location), True otherwise.
+    """
+    self._ProcessPendingCompletions(active)
+
+    breakpoint_id = breakpoint.GetBreakpointId()
+    if breakpoint_id in self._completed:
+      return False
+
+    active[breakpoint_id] = breakpoint
+    self._expiration_timers[breakpoint_id] = self._timers.Schedule(
+        breakpoint.GetExpirationTime(),
+        breakpoint.ExpireBreakpoint)
+    return True
+
+  def _RemoveBreakpoint(self, active, breakpoint_id):
+    """Clears an active breakpoint. Must be called with the lock held."""
+    self._timers.Cancel(self._expiration_timers.pop(breakpoint_id))
+    active.pop(breakpoint_id).Clear()
+
+  def _ProcessPendingCompletions(self, active):
+    """Moves completed breakpoints out of the active breakpoints map.
+
+    Must be called with the lock held.
+
+    Args:
+      active: new version of the active breakpoints map to update.
+    """
+    while True:
+      try:
+        breakpoint_id = self._pending_completions.popleft()
+      except IndexError:
         return
 
-      expired_breakpoints = []
-      self._next_expiration = datetime.max
-      for breakpoint in self._active.itervalues():
-        expiration_time = breakpoint.GetExpirationTime()
-        if expiration_time <= current_time:
-          expired_breakpoints.append(breakpoint)
-        else:
-          self._next_expiration = min(self._next_expiration, expiration_time)
-
-    for breakpoint in expired_breakpoints:
-      breakpoint.ExpireBreakpoint()
+      self._completed.add(breakpoint_id)
+      self._local.discard(breakpoint_id)
+      if breakpoint_id in active:
+        self._RemoveBreakpoint(active, breakpoint_id)
 
   @staticmethod
   def _GetCurrentTime():
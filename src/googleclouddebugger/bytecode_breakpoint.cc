@@ -33,6 +33,11 @@ namespace cdbg {
 // instructions that leaves us with up to 0x0FFF breakpoints.
 static const int kMaxCodeObjectConsts = 0xF000;
 
+// Bytecode of smaller code objects is patched without releasing Interpreter
+// Lock. Their patching takes less time than it would take to reacquire the
+// lock from the other threads.
+static const size_t kMinBytecodeSizeToReleaseLock = 4096;
+
 BytecodeBreakpoint::BytecodeBreakpoint()
     : cookie_counter_(1000000) {
 }
@@ -46,6 +51,7 @@ BytecodeBreakpoint::~BytecodeBreakpoint() {
 void BytecodeBreakpoint::Detach() {
   for (auto it = patches_.begin(); it != patches_.end(); ++it) {
     it->second->breakpoints.clear();
+    ++it->second->generation;
     PatchCodeObject(it->second);
 
     // TODO(vlif): assert zombie_refs.empty() after garbage collection
@@ -102,6 +108,7 @@ int BytecodeBreakpoint::SetBreakpoint(
 
   code_object_breakpoints->breakpoints.insert(
       std::make_pair(breakpoint->offset, breakpoint.get()));
+  ++code_object_breakpoints->generation;
 
   DCHECK(cookie_map_[cookie] == nullptr);
   cookie_map_[cookie] = breakpoint.release();
@@ -118,38 +125,70 @@ void BytecodeBreakpoint::ClearBreakpoint(int cookie) {
     return;  // No breakpoint with this cookie.
   }
 
-  PythonCallback::Disable(it_breakpoint->second->hit_callable.get());
-
-  auto it_code = patches_.find(it_breakpoint->second->code_object);
-  if (it_code != patches_.end()) {
-    CodeObjectBreakpoints* code = it_code->second;
-
-    auto it = code->breakpoints.begin();
-    int erase_count = 0;
-    while (it != code->breakpoints.end()) {
-      if (it->second == it_breakpoint->second) {
-        code->breakpoints.erase(it);
-        ++erase_count;
-        it = code->breakpoints.begin();
-      } else {
-        ++it;
-      }
+  // Unregister the breakpoint before patching, so that another thread can't
+  // clear it again while Interpreter Lock is released.
+  std::unique_ptr<Breakpoint> breakpoint(it_breakpoint->second);
+  cookie_map_.erase(it_breakpoint);
+
+  PythonCallback::Disable(breakpoint->hit_callable.get());
+
+  auto it_code = patches_.find(breakpoint->code_object);
+  if (it_code == patches_.end()) {
+    DCHECK(false) << "Missing code object";
+    return;
+  }
+
+  CodeObjectBreakpoints* code = it_code->second;
+
+  auto it = code->breakpoints.begin();
+  int erase_count = 0;
+  while (it != code->breakpoints.end()) {
+    if (it->second == breakpoint.get()) {
+      code->breakpoints.erase(it);
+      ++erase_count;
+      it = code->breakpoints.begin();
+    } else {
+      ++it;
     }
+  }
+
+  DCHECK_EQ(1, erase_count);
+  ++code->generation;
+
+  PatchCodeObject(code);
+
+  it_code = patches_.find(breakpoint->code_object);
+  if ((it_code != patches_.end()) &&
+      it_code->second->breakpoints.empty() &&
+      it_code->second->zombie_refs.empty()) {
+    delete it_code->second;
+    patches_.erase(it_code);
+  }
+}
 
-    DCHECK_EQ(1, erase_count);
 
-    PatchCodeObject(code);
+int64 BytecodeBreakpoint::GetMemoryUsage() const {
+  int64 size = cookie_map_.size() * sizeof(Breakpoint);
 
-    if (code->breakpoints.empty() && code->zombie_refs.empty()) {
-      delete it_code->second;
-      patches_.erase(it_code);
+  for (const auto& patch : patches_) {
+    const CodeObjectBreakpoints* code = patch.second;
+    size += sizeof(CodeObjectBreakpoints);
+
+    // Bytecode currently installed in the code object is ours while the
+    // code object has breakpoints.
+    if (!code->breakpoints.empty()) {
+      PyCodeObject* code_object = code->code_object.get();
+      size += GetShallowObjectSize(code_object->co_code);
+      size += GetShallowObjectSize(code_object->co_consts);
+      size += GetShallowObjectSize(code_object->co_lnotab);
+    }
+
+    for (const ScopedPyObject& zombie_ref : code->zombie_refs) {
+      size += GetShallowObjectSize(zombie_ref.get());
     }
-  } else {
-    DCHECK(false) << "Missing code object";
   }
 
-  delete it_breakpoint->second;
-  cookie_map_.erase(it_breakpoint);
+  return size;
 }
 
 
@@ -168,6 +207,7 @@ BytecodeBreakpoint::PreparePatchCodeObject(
 
   std::unique_ptr<CodeObjectBreakpoints> data(new CodeObjectBreakpoints);
   data->code_object = code_object;
+  data->generation = 0;
   data->original_stacksize = code_object.get()->co_stacksize;
 
   data->original_consts =
@@ -226,6 +266,10 @@ void BytecodeBreakpoint::PatchCodeObject(CodeObjectBreakpoints* code) {
     return;
   }
 
+  // Copy everything the bytecode manipulation needs, so that it can run
+  // without Interpreter Lock.
+  const int64 generation = code->generation;
+
   std::vector<uint8> bytecode = PyStringToByteArray(code->original_code.get());
 
   bool has_lnotab = false;
@@ -236,28 +280,64 @@ void BytecodeBreakpoint::PatchCodeObject(CodeObjectBreakpoints* code) {
     lnotab = PyStringToByteArray(code->original_lnotab.get());
   }
 
-  BytecodeManipulator bytecode_manipulator(
-      std::move(bytecode),
-      has_lnotab,
-      std::move(lnotab));
+  std::vector<int> offsets;
+  offsets.reserve(code->breakpoints.size());
+  for (const auto& entry : code->breakpoints) {
+    DCHECK_EQ(entry.first, entry.second->offset);
+    offsets.push_back(entry.first);
+  }
+
+  const int original_consts_size =
+      PyTuple_GET_SIZE(code->original_consts.get());
+
+  const bool release_lock = (bytecode.size() >= kMinBytecodeSizeToReleaseLock);
+
+  // Patch the bytecode. Callback of each breakpoint is appended to the code
+  // object constants in the order of "offsets".
+  std::unique_ptr<BytecodeManipulator> bytecode_manipulator;
+  std::vector<bool> injected(offsets.size());
+  auto inject = [&] () {
+    bytecode_manipulator.reset(new BytecodeManipulator(
+        std::move(bytecode),
+        has_lnotab,
+        std::move(lnotab)));
+
+    for (size_t i = 0; i < offsets.size(); ++i) {
+      injected[i] = bytecode_manipulator->InjectMethodCall(
+          offsets[i],
+          original_consts_size + i);
+    }
+  };
+
+  if (release_lock) {
+    Py_BEGIN_ALLOW_THREADS
+    inject();
+    Py_END_ALLOW_THREADS
+
+    // Another thread changed the breakpoints in the meantime, so the new
+    // bytecode is obsolete. Start over, so that the caller's change is
+    // installed by the time this function returns. "code" is still valid:
+    // it either has breakpoints or has been patched before (and has zombie
+    // references), so it wasn't removed from "patches_".
+    if (code->generation != generation) {
+      PatchCodeObject(code);
+      return;
+    }
+  } else {
+    inject();
+  }
 
-  // Add callbacks to code object constants and patch the bytecode.
   std::vector<PyObject*> callbacks;
   callbacks.reserve(code->breakpoints.size());
 
   std::vector<std::function<void()>> errors;
 
-  int const_index = PyTuple_GET_SIZE(code->original_consts.get());
-  for (auto it_entry = code->breakpoints.begin();
-       it_entry != code->breakpoints.end();
-       ++it_entry, ++const_index) {
-    const int offset = it_entry->first;
-    const Breakpoint& breakpoint = *it_entry->second;
-    DCHECK_EQ(offset, breakpoint.offset);
-
+  int index = 0;
+  for (const auto& entry : code->breakpoints) {
+    const Breakpoint& breakpoint = *entry.second;
     callbacks.push_back(breakpoint.hit_callable.get());
 
-    if (!bytecode_manipulator.InjectMethodCall(offset, const_index)) {
+    if (!injected[index++]) {
       LOG(WARNING) << "Failed to insert bytecode for breakpoint "
                    << breakpoint.cookie;
       errors.push_back(breakpoint.error_callback);
@@ -273,8 +353,8 @@ void BytecodeBreakpoint::PatchCodeObject(CodeObjectBreakpoints* code) {
 
   code->zombie_refs.push_back(ScopedPyObject(code_object->co_code));
   ScopedPyObject bytecode_string(PyString_FromStringAndSize(
-      reinterpret_cast<const char*>(bytecode_manipulator.bytecode().data()),
-      bytecode_manipulator.bytecode().size()));
+      reinterpret_cast<const char*>(bytecode_manipulator->bytecode().data()),
+      bytecode_manipulator->bytecode().size()));
   DCHECK(!bytecode_string.is_null());
   code_object->co_code = bytecode_string.release();
   VLOG(1) << "Code object " << CodeObjectDebugString(code_object)
@@ -284,8 +364,8 @@ void BytecodeBreakpoint::PatchCodeObject(CodeObjectBreakpoints* code) {
   if (has_lnotab) {
     code->zombie_refs.push_back(ScopedPyObject(code_object->co_lnotab));
     ScopedPyObject lnotab_string(PyString_FromStringAndSize(
-        reinterpret_cast<const char*>(bytecode_manipulator.lnotab().data()),
-        bytecode_manipulator.lnotab().size()));
+        reinterpret_cast<const char*>(bytecode_manipulator->lnotab().data()),
+        bytecode_manipulator->lnotab().size()));
     DCHECK(!lnotab_string.is_null());
     code_object->co_lnotab = lnotab_string.release();
   }
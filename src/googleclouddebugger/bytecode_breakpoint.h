@@ -55,6 +55,11 @@ class BytecodeBreakpoint {
   // function does nothing.
   void ClearBreakpoint(int cookie);
 
+  // Approximates the memory used by breakpoint bookkeeping, patched
+  // bytecode and zombie references. Must be called with Interpreter Lock
+  // held.
+  int64 GetMemoryUsage() const;
+
  private:
   // Information about the breakpoint.
   struct Breakpoint {
@@ -85,6 +90,11 @@ class BytecodeBreakpoint {
     // a descending order.
     std::multimap<int, Breakpoint*, std::greater<int>> breakpoints;
 
+    // Incremented every time "breakpoints" changes. Bytecode computed
+    // without Interpreter Lock is discarded if the breakpoints changed in
+    // the meantime.
+    int64 generation;
+
     // Python runtime assumes that objects referenced by "PyCodeObject" stay
     // alive as long as the code object is alive. Therefore when patching the
     // code object, we can't just decrement reference count for code and
@@ -116,6 +126,11 @@ class BytecodeBreakpoint {
   // Patches the code object with breakpoints. If the code object has no more
   // breakpoints, resets the code object to its original state. This operation
   // is idempotent.
+  //
+  // The new bytecode of large code objects is computed with Interpreter Lock
+  // released, so other threads may set or clear breakpoints meanwhile. The
+  // caller must not keep iterators of "patches_" or "cookie_map_" across
+  // this call.
   void PatchCodeObject(CodeObjectBreakpoints* code);
 
  private:
@@ -19,9 +19,11 @@
 import copy
 import datetime
 import inspect
+import json
 import os
 import re
 import sys
+import threading
 import types
 
 import cdbg_native as native
@@ -37,12 +39,49 @@ _PRIMITIVE_TYPES = (int, long, float, complex, str, unicode, bool,
 _DATE_TYPES = (datetime.date, datetime.time, datetime.timedelta)
 _VECTOR_TYPES = (types.TupleType, types.ListType, types.SliceType, set)
 
+# Serialized first entry of the variables table that all the references to
+# variables that didn't fit into the capture point to.
+_BUFFER_FULL_VARIABLE_JSON = native.EncodeJson({
+    'status': {
+        'isError': True,
+        'refersTo': 'VARIABLE_VALUE',
+        'description': {'format': 'Buffer full'}}})
+
+# Categories of captured values that determine how the value is formatted.
+_PRIMITIVE = 0
+_DATE = 1
+_DICT = 2
+_VECTOR = 3
+_FUNCTION = 4
+_OBJECT = 5
+
+# Pretty printers registered with RegisterPrettyPrinter keyed by type.
+_typed_pretty_printers = {}
+
+# Resolved (category, pretty printer) tuple keyed by the exact type of the
+# captured value. Filled on first use of each type by _ResolveType.
+_type_cache = {}
+
+# Maximum number of entries in _type_cache. The cache is cleared when it gets
+# full, so that dynamically created classes are not kept alive forever.
+_MAX_TYPE_CACHE_SIZE = 1000
+
 # TODO(vlif): move to messages.py module.
 EMPTY_DICTIONARY = 'Empty dictionary'
 EMPTY_COLLECTION = 'Empty collection'
 OBJECT_HAS_NO_FIELDS = 'Object has no fields'
 LOG_ACTION_NOT_SUPPORTED = 'Log action on a breakpoint not supported'
 INVALID_EXPRESSION_INDEX = '<N/A>'
+MESSAGE_REPEATED = '$0 [repeated $1 times]'
+
+# Maximum number of distinct messages per logpoint tracked for duplicate
+# suppression. Messages beyond this limit are always logged.
+MAX_DEDUPLICATED_MESSAGES = 100
+
+# Copy of sys.path at the time the code object metadata cache was filled.
+# Normalized paths depend on sys.path, so the cache is invalidated when it
+# changes.
+_sys_path_snapshot = None
 
 
 class CaptureCollector(object):
@@ -55,15 +94,22 @@ class CaptureCollector(object):
   completion of the user request will be delayed until the collection is over.
   It might make sense to implement this logic in C++.
 
+  Entries of the variables table are serialized into JSON as soon as they are
+  captured, so that the intermediate dictionaries don't pile up for large
+  captures. Once the collection is over, the variables table is a single
+  native.CreateJsonFragment object that native.EncodeJson inserts as is.
+
   Attributes:
     breakpoint: breakpoint definition augmented with captured call stack,
         local variables, arguments and referenced objects.
   """
 
-  # Additional type-specific printers. Each pretty printer is a callable
-  # that returns None if it doesn't recognize the object or returns a tuple
-  # with iterable enumerating object fields (name-value tuple) and object type
-  # string.
+  # Additional printers not bound to a type (see RegisterPrettyPrinter for
+  # type-specific printers). Each pretty printer is a callable that returns
+  # None if it doesn't recognize the object or returns a tuple with iterable
+  # enumerating object fields (name-value tuple) and object type string.
+  # These are tried for every object without a type-specific printer, so
+  # RegisterPrettyPrinter is preferred.
   pretty_printers = []
 
   def __init__(self, definition):
@@ -77,14 +123,23 @@ class CaptureCollector(object):
 
     self.breakpoint['stackFrames'] = []
     self.breakpoint['evaluatedExpressions'] = []
-    self.breakpoint['variableTable'] = [{
-        'status': {
-            'isError': True,
-            'refersTo': 'VARIABLE_VALUE',
-            'description': {'format': 'Buffer full'}}}]
 
-    # Shortcut to variables table in the breakpoint message.
-    self._var_table = self.breakpoint['variableTable']
+    # Objects referenced from the captured data in the order of their index in
+    # the variables table. The first entry is the "buffer full" placeholder.
+    # The objects are kept alive until the capture completes: the index below
+    # is keyed by object ID, which CPython reuses once an object is freed.
+    self._var_table = [None]
+
+    # Captured entries of the variables table serialized into JSON.
+    self._encoded_var_table = [_BUFFER_FULL_VARIABLE_JSON]
+
+    # Highest variables table index referenced by each encoded entry. Entries
+    # referencing variables that don't make it into the table are decoded and
+    # fixed when the table is trimmed.
+    self._encoded_max_index = [0]
+
+    # Highest variables table index referenced by the variable being captured.
+    self._max_index = 0
 
     # Maps object ID to its index in variables table.
     self._var_table_index = {}
@@ -127,11 +182,14 @@ class CaptureCollector(object):
     Args:
       top_frame: top frame to start data collection.
     """
+    _ValidateCodeMetadataCache()
+
     # Evaluate call stack.
     frame = top_frame
     breakpoint_frames = self.breakpoint['stackFrames']
     while frame and (len(breakpoint_frames) < self.max_frames):
-      code = frame.f_code
+      function, path, _ = native.GetCodeMetadata(
+          frame.f_code, _ComputeCodeMetadata)
       if len(breakpoint_frames) < self.max_expand_frames:
         frame_arguments, frame_locals = self.CaptureFrameLocals(frame)
       else:
@@ -139,9 +197,9 @@ class CaptureCollector(object):
         frame_locals = []
 
       breakpoint_frames.append({
-          'function': code.co_name,
+          'function': function,
           'location': {
-              'path': CaptureCollector._NormalizePath(code.co_filename),
+              'path': path,
               'line': frame.f_lineno},
           'arguments': frame_arguments,
           'locals': frame_locals})
@@ -157,13 +215,24 @@ class CaptureCollector(object):
     # inside CaptureVariable as we encounter new references.
     i = 1
     while (i < len(self._var_table)) and (self._total_size < self.max_size):
-      self._var_table[i] = self.CaptureVariable(self._var_table[i], 0, False)
+      self._max_index = 0
+      variable = self.CaptureVariable(self._var_table[i], 0, False)
+      self._encoded_var_table.append(native.EncodeJson(variable))
+      self._encoded_max_index.append(self._max_index)
       i += 1
 
     # Trim variables table and change make all references to variables that
     # didn't make it point to var_index of 0 ("buffer full")
     self.TrimVariableTable(i)
 
+    self.breakpoint['variableTable'] = native.CreateJsonFragment(
+        '[' + ','.join(self._encoded_var_table) + ']')
+    self._encoded_var_table = None
+
+    # Release the captured objects together with the index keyed by their IDs.
+    self._var_table = None
+    self._var_table_index = None
+
   def CaptureFrameLocals(self, frame):
     """Captures local variables and arguments of the specified frame.
 
@@ -178,12 +247,11 @@ class CaptureCollector(object):
                  for n, v in frame.f_locals.viewitems()}
 
     # Split between locals and arguments (keeping arguments in the right order).
-    nargs = frame.f_code.co_argcount
-    if frame.f_code.co_flags & inspect.CO_VARARGS: nargs += 1
-    if frame.f_code.co_flags & inspect.CO_VARKEYWORDS: nargs += 1
+    _, _, argnames = native.GetCodeMetadata(
+        frame.f_code, _ComputeCodeMetadata)
 
     frame_arguments = []
-    for argname in frame.f_code.co_varnames[:nargs]:
+    for argname in argnames:
       if argname in variables: frame_arguments.append(variables.pop(argname))
 
     return (frame_arguments, list(variables.viewvalues()))
@@ -261,31 +329,35 @@ class CaptureCollector(object):
       self._total_size += 4
       return {'value': 'None'}
 
-    if isinstance(value, _PRIMITIVE_TYPES):
+    value_type = type(value)
+    category, type_pretty_printer = (_type_cache.get(value_type) or
+                                     _ResolveType(value_type))
+
+    if category == _PRIMITIVE:
       r = _TrimString(repr(value),  # Primitive type, always immutable.
                       self.max_value_len)
       self._total_size += len(r)
-      return {'value': r, 'type': type(value).__name__}
+      return {'value': r, 'type': value_type.__name__}
 
-    if isinstance(value, _DATE_TYPES):
+    if category == _DATE:
       r = str(value)  # Safe to call str().
       self._total_size += len(r)
-      return {'value': r, 'type': 'datetime.'+ type(value).__name__}
+      return {'value': r, 'type': 'datetime.'+ value_type.__name__}
 
-    if isinstance(value, dict):
+    if category == _DICT:
       return {'members': self.CaptureVariablesList(value.iteritems(),
                                                    depth + 1,
                                                    EMPTY_DICTIONARY),
               'type': 'dict'}
 
-    if isinstance(value, _VECTOR_TYPES):
+    if category == _VECTOR:
       fields = self.CaptureVariablesList(
           (('[%d]' % i, x) for i, x in enumerate(value)),
           depth + 1,
           EMPTY_COLLECTION)
-      return {'members': fields, 'type': type(value).__name__}
+      return {'members': fields, 'type': value_type.__name__}
 
-    if isinstance(value, types.FunctionType):
+    if category == _FUNCTION:
       self._total_size += len(value.func_name)
       # TODO(vlif): set value to func_name and type to 'function'
       return {'value': 'function ' + value.func_name}
@@ -296,14 +368,18 @@ class CaptureCollector(object):
         index = len(self._var_table)
         self._var_table_index[id(value)] = index
         self._var_table.append(value)
+      self._max_index = max(self._max_index, index)
       self._total_size += 4  # number of characters to accomodate a number.
       return {'varTableIndex': index}
 
-    for pretty_printer in CaptureCollector.pretty_printers:
-      pretty_value = pretty_printer(value)
-      if not pretty_value:
-        continue
+    pretty_value = type_pretty_printer and type_pretty_printer(value)
+    if not pretty_value:
+      for pretty_printer in CaptureCollector.pretty_printers:
+        pretty_value = pretty_printer(value)
+        if pretty_value:
+          break
 
+    if pretty_value:
       fields, object_type = pretty_value
       return {'members': self.CaptureVariablesList(fields,
                                                    depth + 1,
@@ -359,7 +435,8 @@ class CaptureCollector(object):
 
     Removes trailing entries in variables table. Then scans the entire
     breakpoint message and replaces references to the trimmed variables to
-    point to var_index of 0 ("buffer full").
+    point to var_index of 0 ("buffer full"). Only the encoded entries that
+    reference trimmed variables are decoded and encoded again.
 
     Args:
       new_size: desired size of variables table.
@@ -375,12 +452,19 @@ class CaptureCollector(object):
           ProcessBufferFull(members)
 
     del self._var_table[new_size:]
+    del self._encoded_var_table[new_size:]
+    del self._encoded_max_index[new_size:]
     for stack_frame in self.breakpoint['stackFrames']:
       ProcessBufferFull(stack_frame['arguments'])
       ProcessBufferFull(stack_frame['locals'])
-    ProcessBufferFull(self._var_table)
     ProcessBufferFull(self.breakpoint['evaluatedExpressions'])
 
+    for i, max_index in enumerate(self._encoded_max_index):
+      if max_index >= new_size:
+        variable = json.loads(self._encoded_var_table[i])
+        ProcessBufferFull([variable])
+        self._encoded_var_table[i] = native.EncodeJson(variable)
+
   @staticmethod
   def _NormalizePath(path):
     """Converts an absolute path to a relative one.
@@ -422,13 +506,15 @@ class LogCollector(object):
   The actual log functions are defined globally outside of this module.
   """
 
-  def __init__(self, definition):
+  def __init__(self, definition, deduplicator=None):
     """Class constructor.
 
     Args:
       definition: breakpoint definition indicating log level, message, etc.
+      deduplicator: optional LogDeduplicator of the logpoint.
     """
     self._definition = definition
+    self._deduplicator = deduplicator
 
     # Maximum number of character to allow for a single value. Longer strings
     # are truncated.
@@ -467,7 +553,10 @@ class LogCollector(object):
         self._definition.get('logMessageFormat', ''),
         self._EvaluateExpressions(frame))
 
-    self._log_message(message)
+    if self._deduplicator:
+      self._deduplicator.Log(self._log_message, message)
+    else:
+      self._log_message(message)
     return None
 
   def _EvaluateExpressions(self, frame):
@@ -498,7 +587,8 @@ class LogCollector(object):
     Returns:
       Formatted expression value that can be used in the log message.
     """
-    rc, value = _EvaluateExpression(frame, expression)
+    rc, value = _EvaluateExpression(
+        frame, expression, native.EXPRESSION_KIND_LOG)
     if not rc:
       message = _FormatMessage(value['description']['format'],
                                value['description'].get('parameters'))
@@ -543,23 +633,26 @@ class LogCollector(object):
       """Formats a list using a custom item formatter enforcing threshold."""
       return ', '.join(LimitedEnumerate(items, formatter))
 
-    if isinstance(value, _PRIMITIVE_TYPES):
+    value_type = type(value)
+    category, _ = _type_cache.get(value_type) or _ResolveType(value_type)
+
+    if category == _PRIMITIVE:
       return _TrimString(repr(value),  # Primitive type, always immutable.
                          self.max_value_len)
 
-    if isinstance(value, _DATE_TYPES):
+    if category == _DATE:
       return str(value)
 
     if level > 0:
-      return str(type(value))
+      return str(value_type)
 
-    if isinstance(value, dict):
+    if category == _DICT:
       return '{' + FormatList(value.iteritems(), FormatDictItem) + '}'
 
-    if isinstance(value, _VECTOR_TYPES):
+    if category == _VECTOR:
       return FormatList(value, lambda item: self._FormatValue(item, level + 1))
 
-    if isinstance(value, types.FunctionType):
+    if category == _FUNCTION:
       return 'function ' + value.func_name
 
     if hasattr(value, '__dict__') and value.__dict__:
@@ -568,12 +661,161 @@ class LogCollector(object):
     return str(type(value))
 
 
-def _EvaluateExpression(frame, expression):
+class LogDeduplicator(object):
+  """Suppresses repeated messages of a single logpoint.
+
+  Logpoints on hot error paths tend to produce the same message over and
+  over. The first occurrence of a message is logged right away. Further
+  occurrences are only counted until the next call to Flush, which logs a
+  single summary for each repeated message. Messages that weren't repeated
+  since the previous flush are forgotten, so they are logged again the next
+  time they occur.
+
+  This class is thread safe.
+  """
+
+  def __init__(self, max_messages=MAX_DEDUPLICATED_MESSAGES):
+    self._lock = threading.Lock()
+    self._max_messages = max_messages
+
+    # Number of suppressed occurrences since the last flush keyed by message.
+    self._repeat_counts = {}
+
+    # Log function of the last tracked message (logpoint level is fixed).
+    self._log_message = None
+
+  def Log(self, log_message, message):
+    """Logs the message unless it's a repetition of a recent message.
+
+    Args:
+      log_message: log function to use.
+      message: formatted logpoint message.
+    """
+    with self._lock:
+      count = self._repeat_counts.get(message)
+      if count is not None:
+        self._repeat_counts[message] = count + 1
+        return
+
+      if len(self._repeat_counts) < self._max_messages:
+        self._repeat_counts[message] = 0
+        self._log_message = log_message
+
+    log_message(message)
+
+  def Flush(self):
+    """Logs summary of the messages suppressed since the previous flush."""
+    with self._lock:
+      repeated = [(message, count)
+                  for message, count in self._repeat_counts.iteritems()
+                  if count]
+      self._repeat_counts = {message: 0 for message, _ in repeated}
+      log_message = self._log_message
+
+    for message, count in repeated:
+      log_message(_FormatMessage(MESSAGE_REPEATED, [message, str(count)]))
+
+
+def RegisterPrettyPrinter(object_type, pretty_printer):
+  """Registers pretty printer for objects of the specified type.
+
+  The pretty printer also applies to subclasses of "object_type" unless they
+  have a pretty printer of their own. It is only used for objects that are
+  not formatted by the built-in rules (primitive types, dates, dictionaries,
+  sequences and functions).
+
+  Args:
+    object_type: new style class.
+    pretty_printer: callable with the same semantics as the items of
+        CaptureCollector.pretty_printers.
+  """
+  _typed_pretty_printers[object_type] = pretty_printer
+  _type_cache.clear()
+
+
+def ClearCaches():
+  """Releases memory of the per type and per code object caches.
+
+  The caches are repopulated on the next capture.
+  """
+  _type_cache.clear()
+  native.ClearCodeMetadataCache()
+
+
+def _ResolveType(value_type):
+  """Computes and caches the category and pretty printer of a type.
+
+  Args:
+    value_type: exact type of the captured value.
+
+  Returns:
+    (category, pretty printer) tuple. The pretty printer is None if there is
+    no type-specific pretty printer in the type hierarchy.
+  """
+  if issubclass(value_type, _PRIMITIVE_TYPES):
+    category = _PRIMITIVE
+  elif issubclass(value_type, _DATE_TYPES):
+    category = _DATE
+  elif issubclass(value_type, dict):
+    category = _DICT
+  elif issubclass(value_type, _VECTOR_TYPES):
+    category = _VECTOR
+  elif issubclass(value_type, types.FunctionType):
+    category = _FUNCTION
+  else:
+    category = _OBJECT
+
+  pretty_printer = None
+  if category == _OBJECT:
+    for base in inspect.getmro(value_type):
+      pretty_printer = _typed_pretty_printers.get(base)
+      if pretty_printer:
+        break
+
+  if len(_type_cache) >= _MAX_TYPE_CACHE_SIZE:
+    _type_cache.clear()
+
+  entry = (category, pretty_printer)
+  _type_cache[value_type] = entry
+  return entry
+
+
+def _ComputeCodeMetadata(code):
+  """Computes the frame independent information captured for a code object.
+
+  Called by native.GetCodeMetadata on cache miss.
+
+  Args:
+    code: code object of a captured frame.
+
+  Returns:
+    (function name, normalized source path, argument names) tuple.
+  """
+  nargs = code.co_argcount
+  if code.co_flags & inspect.CO_VARARGS: nargs += 1
+  if code.co_flags & inspect.CO_VARKEYWORDS: nargs += 1
+
+  return (code.co_name,
+          CaptureCollector._NormalizePath(code.co_filename),
+          tuple(code.co_varnames[:nargs]))
+
+
+def _ValidateCodeMetadataCache():
+  """Clears the code object metadata cache if sys.path has changed."""
+  global _sys_path_snapshot
+  if _sys_path_snapshot != sys.path:
+    native.ClearCodeMetadataCache()
+    _sys_path_snapshot = list(sys.path)
+
+
+def _EvaluateExpression(frame, expression,
+                        kind=native.EXPRESSION_KIND_WATCH):
   """Compiles and evaluates watched expression.
 
   Args:
     frame: evaluation context.
     expression: watched expression to compile and evaluate.
+    kind: native.EXPRESSION_KIND_XXX constant selecting the time limits.
 
   Returns:
     (False, status) on error or (True, value) on success.
@@ -596,7 +838,7 @@ def _EvaluateExpression(frame, expression):
             'parameters': [e.msg]}})
 
   try:
-    return (True, native.CallImmutable(frame, code))
+    return (True, native.CallImmutable(frame, code, kind))
   except BaseException as e:
     return (False, {
         'isError': True,
@@ -0,0 +1,155 @@
+/**
+ * Copyright 2015 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Ensure that Python.h is included before any other header.
+#include "common.h"
+
+#include "code_metadata_cache.h"
+
+#include <unordered_map>
+
+#include "python_util.h"
+
+DEFINE_int32(
+    max_code_metadata_cache_size,
+    10000,
+    "maximum number of code objects in the metadata cache of capture "
+    "collector");
+
+namespace devtools {
+namespace cdbg {
+
+// Single cache entry.
+struct CodeMetadataEntry {
+  // Value returned by the factory.
+  ScopedPyObject metadata;
+
+  // Weak reference to the code object with "OnCodeObjectCollected" callback.
+  ScopedPyObject weak_code;
+};
+
+static std::unordered_map<PyCodeObject*, CodeMetadataEntry> g_code_metadata;
+
+static PyObject* OnCodeObjectCollected(PyObject* self, PyObject* weak_code);
+
+// Callback of the weak reference to the code object. The code object
+// address is stored as "self" of the callback function object.
+static PyMethodDef g_on_code_object_collected_def = {
+  const_cast<char*>("OnCodeObjectCollected"),
+  OnCodeObjectCollected,
+  METH_O,
+  nullptr
+};
+
+
+static PyObject* OnCodeObjectCollected(PyObject* self, PyObject* weak_code) {
+  PyCodeObject* code = reinterpret_cast<PyCodeObject*>(
+      PyLong_AsVoidPtr(self));
+
+  auto it = g_code_metadata.find(code);
+  if ((it != g_code_metadata.end()) && (it->second.weak_code == weak_code)) {
+    // Destroying the entry might release other objects. Don't let it run
+    // while the map is being modified.
+    CodeMetadataEntry entry = it->second;
+    g_code_metadata.erase(it);
+  }
+
+  Py_RETURN_NONE;
+}
+
+
+PyObject* GetCodeMetadata(PyCodeObject* code, PyObject* factory) {
+  auto it = g_code_metadata.find(code);
+  if (it != g_code_metadata.end()) {
+    PyObject* metadata = it->second.metadata.get();
+    Py_INCREF(metadata);
+    return metadata;
+  }
+
+  ScopedPyObject metadata(PyObject_CallFunctionObjArgs(
+      factory,
+      reinterpret_cast<PyObject*>(code),
+      nullptr));
+  if (metadata == nullptr) {
+    return nullptr;
+  }
+
+  ScopedPyObject code_address(PyLong_FromVoidPtr(code));
+  if (code_address == nullptr) {
+    return nullptr;
+  }
+
+  ScopedPyObject callback(PyCFunction_NewEx(
+      &g_on_code_object_collected_def,
+      code_address.get(),
+      nullptr));
+  if (callback == nullptr) {
+    return nullptr;
+  }
+
+  ScopedPyObject weak_code(PyWeakref_NewRef(
+      reinterpret_cast<PyObject*>(code),
+      callback.get()));
+  if (weak_code == nullptr) {
+    // Can't track the lifetime of this code object, don't cache it.
+    PyErr_Clear();
+    return metadata.release();
+  }
+
+  if (g_code_metadata.size() >=
+      static_cast<size_t>(FLAGS_max_code_metadata_cache_size)) {
+    ClearCodeMetadataCache();
+  }
+
+  g_code_metadata[code] = { metadata, weak_code };
+
+  return metadata.release();
+}
+
+
+int64 GetCodeMetadataCacheMemoryUsage() {
+  // Map node (key, value and the pointer to the next node) and the bucket.
+  int64 size = g_code_metadata.bucket_count() * sizeof(void*);
+
+  for (const auto& entry : g_code_metadata) {
+    size += sizeof(entry) + sizeof(void*);
+    size += GetShallowObjectSize(entry.second.metadata.get());
+
+    // The weak reference and its callback. The callback holds the boxed code
+    // object address.
+    PyObject* weak_code = entry.second.weak_code.get();
+    size += GetShallowObjectSize(weak_code);
+    PyObject* callback =
+        reinterpret_cast<PyWeakReference*>(weak_code)->wr_callback;
+    if (callback != nullptr) {
+      size += GetShallowObjectSize(callback);
+      size += GetShallowObjectSize(PyCFunction_GET_SELF(callback));
+    }
+  }
+
+  return size;
+}
+
+
+void ClearCodeMetadataCache() {
+  // Releasing the weak references cancels their callbacks. Release them
+  // after the map is emptied, since releasing objects can run arbitrary code.
+  std::unordered_map<PyCodeObject*, CodeMetadataEntry> entries;
+  entries.swap(g_code_metadata);
+}
+
+}  // namespace cdbg
+}  // namespace devtools
@@ -0,0 +1,55 @@
+/**
+ * Copyright 2015 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DEVTOOLS_CDBG_DEBUGLETS_PYTHON_CODE_METADATA_CACHE_H_
+#define DEVTOOLS_CDBG_DEBUGLETS_PYTHON_CODE_METADATA_CACHE_H_
+
+#include "common.h"
+
+namespace devtools {
+namespace cdbg {
+
+// Cache of per code object metadata used when capturing stack frames (like
+// the normalized source path and the argument names).
+//
+// The cache is keyed by code object identity. Each entry holds a weak
+// reference to its code object, so the entry is removed when the code object
+// is garbage collected (and the address can't be reused by another code
+// object while the entry is still there). The cache doesn't keep code objects
+// alive.
+//
+// The metadata is computed by a Python callable on cache miss. The cache
+// doesn't interpret it.
+//
+// All functions must be called with Interpreter Lock held.
+
+// Gets the cached metadata of "code" or calls "factory(code)" to compute it.
+// Returns new reference or nullptr (with Python exception set) if "factory"
+// failed.
+PyObject* GetCodeMetadata(PyCodeObject* code, PyObject* factory);
+
+// Removes all the entries. Used when the inputs of the metadata change (for
+// example when "sys.path" changes) and to release memory.
+void ClearCodeMetadataCache();
+
+// Approximates the memory used by the cache (excluding the objects that the
+// cached metadata references).
+int64 GetCodeMetadataCacheMemoryUsage();
+
+}  // namespace cdbg
+}  // namespace devtools
+
+#endif  // DEVTOOLS_CDBG_DEBUGLETS_PYTHON_CODE_METADATA_CACHE_H_
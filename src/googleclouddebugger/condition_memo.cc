@@ -0,0 +1,394 @@
+/**
+ * Copyright 2015 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Ensure that Python.h is included before any other header.
+#include "common.h"
+
+#include "condition_memo.h"
+
+#include <string.h>
+
+#include "opcode.h"
+
+namespace devtools {
+namespace cdbg {
+
+// Maximum number of memoized results per condition. When the cache is full,
+// the entries are replaced in round robin order.
+static const size_t kMaxEntries = 64;
+
+// Strings longer than this are not memoized. Each entry keeps its values
+// alive, so the cache shouldn't hold on to large strings.
+static const Py_ssize_t kMaxStringSize = 256;
+
+
+// Checks whether "obj" is a constant that a pure condition can use.
+static bool IsPrimitiveConstant(PyObject* obj) {
+  if ((obj == Py_None) ||
+      PyBool_Check(obj) ||
+      PyInt_CheckExact(obj) ||
+      PyLong_CheckExact(obj) ||
+      PyFloat_CheckExact(obj) ||
+      PyString_CheckExact(obj) ||
+      PyUnicode_CheckExact(obj)) {
+    return true;
+  }
+
+  // Constant tuples come from expressions like "x in ('a', 'b')".
+  if (PyTuple_CheckExact(obj)) {
+    for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(obj); ++i) {
+      if (!IsPrimitiveConstant(PyTuple_GET_ITEM(obj, i))) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  return false;
+}
+
+
+// Checks whether the result of the condition can be memoized for this value
+// of a name that the condition reads.
+static bool IsPrimitiveValue(PyObject* obj) {
+  if (PyString_CheckExact(obj)) {
+    return PyString_GET_SIZE(obj) <= kMaxStringSize;
+  }
+
+  if (PyUnicode_CheckExact(obj)) {
+    return PyUnicode_GET_SIZE(obj) <= kMaxStringSize;
+  }
+
+  return (obj == Py_None) ||
+         PyBool_Check(obj) ||
+         PyInt_CheckExact(obj) ||
+         PyLong_CheckExact(obj) ||
+         PyFloat_CheckExact(obj);
+}
+
+
+// Checks whether two primitive values are interchangeable as inputs of a
+// pure condition.
+static bool IsSameValue(PyObject* value1, PyObject* value2) {
+  if (value1 == value2) {
+    return true;
+  }
+
+  // Values of different types can be equal (like 1 and 1.0), but the
+  // condition can still tell them apart (for example with "/").
+  if (Py_TYPE(value1) != Py_TYPE(value2)) {
+    return false;
+  }
+
+  // Floats are compared bitwise: 0.0 and -0.0 are equal, but have different
+  // representation, while NaN is not equal even to itself.
+  if (PyFloat_CheckExact(value1)) {
+    const double double1 = PyFloat_AS_DOUBLE(value1);
+    const double double2 = PyFloat_AS_DOUBLE(value2);
+    return memcmp(&double1, &double2, sizeof(double)) == 0;
+  }
+
+  const int rc = PyObject_RichCompareBool(value1, value2, Py_EQ);
+  if (rc == -1) {
+    PyErr_Clear();
+    return false;
+  }
+
+  return rc == 1;
+}
+
+
+// Finds the index of "name" in the tuple of names or returns -1.
+static int FindName(PyObject* names, PyObject* name) {
+  const Py_ssize_t size = PyTuple_GET_SIZE(names);
+
+  // Names are interned, so the pointer comparison almost always suffices.
+  for (Py_ssize_t i = 0; i < size; ++i) {
+    if (PyTuple_GET_ITEM(names, i) == name) {
+      return i;
+    }
+  }
+
+  for (Py_ssize_t i = 0; i < size; ++i) {
+    if (_PyString_Eq(PyTuple_GET_ITEM(names, i), name)) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+
+std::unique_ptr<ConditionMemo> ConditionMemo::Create(PyCodeObject* condition) {
+  if (!PyString_CheckExact(condition->co_code)) {
+    return nullptr;
+  }
+
+  const uint8* opcodes =
+      reinterpret_cast<const uint8*>(PyString_AS_STRING(condition->co_code));
+  const int size = PyString_GET_SIZE(condition->co_code);
+
+  std::vector<ScopedPyObject> names;
+
+  // Constant loaded by the previous instruction or nullptr.
+  PyObject* previous_constant = nullptr;
+
+  int offset = 0;
+  while (offset < size) {
+    const uint8 opcode = opcodes[offset];
+    int arg = 0;
+    if (HAS_ARG(opcode)) {
+      if (offset + 3 > size) {
+        return nullptr;
+      }
+
+      arg = (static_cast<uint16>(opcodes[offset + 2]) << 8) |
+            opcodes[offset + 1];
+      offset += 3;
+    } else {
+      offset += 1;
+    }
+
+    PyObject* constant = nullptr;
+
+    switch (opcode) {
+      // Stack manipulation, operators and control flow within the
+      // expression. Applied to primitive values, these don't call any
+      // Python code.
+      case NOP:
+      case POP_TOP:
+      case ROT_TWO:
+      case ROT_THREE:
+      case DUP_TOP:
+      case UNARY_POSITIVE:
+      case UNARY_NEGATIVE:
+      case UNARY_NOT:
+      case UNARY_CONVERT:
+      case UNARY_INVERT:
+      case BINARY_POWER:
+      case BINARY_MULTIPLY:
+      case BINARY_DIVIDE:
+      case BINARY_TRUE_DIVIDE:
+      case BINARY_FLOOR_DIVIDE:
+      case BINARY_MODULO:
+      case BINARY_ADD:
+      case BINARY_SUBTRACT:
+      case BINARY_SUBSCR:
+      case BINARY_LSHIFT:
+      case BINARY_RSHIFT:
+      case BINARY_AND:
+      case BINARY_XOR:
+      case BINARY_OR:
+      case SLICE+0:
+      case SLICE+1:
+      case SLICE+2:
+      case SLICE+3:
+      case BUILD_TUPLE:
+      case JUMP_FORWARD:
+      case JUMP_IF_FALSE_OR_POP:
+      case JUMP_IF_TRUE_OR_POP:
+      case POP_JUMP_IF_FALSE:
+      case POP_JUMP_IF_TRUE:
+      case RETURN_VALUE:
+        break;
+
+      case LOAD_CONST:
+        constant = PyTuple_GET_ITEM(condition->co_consts, arg);
+        if (!IsPrimitiveConstant(constant)) {
+          return nullptr;
+        }
+        break;
+
+      case LOAD_NAME: {
+        PyObject* name = PyTuple_GET_ITEM(condition->co_names, arg);
+        bool is_new_name = true;
+        for (const ScopedPyObject& existing_name : names) {
+          is_new_name &= (existing_name.get() != name);
+        }
+
+        if (is_new_name) {
+          names.push_back(ScopedPyObject::NewReference(name));
+        }
+        break;
+      }
+
+      case COMPARE_OP:
+        switch (arg) {
+          // Identity of equal values is only defined for singletons, so
+          // allow "x is None" and alike, but not "x is y".
+          case PyCmp_IS:
+          case PyCmp_IS_NOT:
+            if ((previous_constant != Py_None) &&
+                (previous_constant != Py_True) &&
+                (previous_constant != Py_False)) {
+              return nullptr;
+            }
+            break;
+
+          case PyCmp_EXC_MATCH:
+            return nullptr;
+
+          default:
+            break;
+        }
+        break;
+
+      // Function calls, attributes, comprehensions, lambdas and anything
+      // else.
+      default:
+        return nullptr;
+    }
+
+    previous_constant = constant;
+  }
+
+  return std::unique_ptr<ConditionMemo>(new ConditionMemo(std::move(names)));
+}
+
+
+ConditionMemo::ConditionMemo(std::vector<ScopedPyObject> names)
+    : names_(std::move(names)),
+      next_victim_(0) {
+}
+
+
+PyObject* ConditionMemo::LookupLocal(
+    PyFrameObject* frame,
+    PyObject* name,
+    bool* is_supported) {
+  PyCodeObject* code = frame->f_code;
+  const int cells_count = PyTuple_GET_SIZE(code->co_cellvars);
+  const int free_count = PyTuple_GET_SIZE(code->co_freevars);
+
+  // Module level code (or a class body) keeps its variables in the
+  // dictionary.
+  if (!(code->co_flags & CO_OPTIMIZED)) {
+    if ((cells_count > 0) ||
+        (free_count > 0) ||
+        (frame->f_locals == nullptr) ||
+        !PyDict_CheckExact(frame->f_locals)) {
+      *is_supported = false;
+      return nullptr;
+    }
+
+    return PyDict_GetItem(frame->f_locals, name);
+  }
+
+  // "PyFrame_FastToLocals" copies cells after the local variables, so cells
+  // take precedence (an argument can also be a cell).
+  PyObject** cells = frame->f_localsplus + code->co_nlocals;
+  int index = FindName(code->co_cellvars, name);
+  if (index == -1) {
+    index = FindName(code->co_freevars, name);
+    if (index != -1) {
+      index += cells_count;
+    }
+  }
+
+  if (index != -1) {
+    PyObject* cell = cells[index];
+    return ((cell != nullptr) && PyCell_Check(cell)) ? PyCell_GET(cell)
+                                                       : nullptr;
+  }
+
+  index = FindName(code->co_varnames, name);
+  if ((index != -1) && (index < code->co_nlocals)) {
+    return frame->f_localsplus[index];
+  }
+
+  return nullptr;
+}
+
+
+bool ConditionMemo::BuildKey(PyFrameObject* frame, Key* key) const {
+  key->values.clear();
+  key->values.reserve(names_.size());
+  key->hash = names_.size();
+
+  for (const ScopedPyObject& name : names_) {
+    // Unbound local variables fall back to globals just like they do when
+    // the condition is evaluated on "frame->f_locals".
+    bool is_supported = true;
+    PyObject* value = LookupLocal(frame, name.get(), &is_supported);
+    if (!is_supported) {
+      return false;
+    }
+
+    if (value == nullptr) {
+      value = PyDict_GetItem(frame->f_globals, name.get());
+    }
+
+    if ((value == nullptr) && (frame->f_builtins != nullptr)) {
+      value = PyDict_GetItem(frame->f_builtins, name.get());
+    }
+
+    if ((value == nullptr) || !IsPrimitiveValue(value)) {
+      return false;
+    }
+
+    const long value_hash = PyObject_Hash(value);  // NOLINT
+    if (value_hash == -1) {
+      PyErr_Clear();
+      return false;
+    }
+
+    key->hash = (key->hash * 1000003) ^
+                static_cast<size_t>(value_hash) ^
+                reinterpret_cast<size_t>(Py_TYPE(value));
+    key->values.push_back(ScopedPyObject::NewReference(value));
+  }
+
+  return true;
+}
+
+
+Nullable<bool> ConditionMemo::Lookup(const Key& key) const {
+  for (const Entry& entry : entries_) {
+    if (entry.key.hash != key.hash) {
+      continue;
+    }
+
+    bool is_match = true;
+    for (size_t i = 0; is_match && (i < key.values.size()); ++i) {
+      is_match = IsSameValue(entry.key.values[i].get(), key.values[i].get());
+    }
+
+    if (is_match) {
+      return Nullable<bool>(entry.result);
+    }
+  }
+
+  return Nullable<bool>();
+}
+
+
+void ConditionMemo::Store(Key key, bool result) {
+  Entry entry;
+  entry.key = std::move(key);
+  entry.result = result;
+
+  if (entries_.size() < kMaxEntries) {
+    entries_.push_back(std::move(entry));
+    return;
+  }
+
+  entries_[next_victim_] = std::move(entry);
+  next_victim_ = (next_victim_ + 1) % kMaxEntries;
+}
+
+}  // namespace cdbg
+}  // namespace devtools
@@ -0,0 +1,103 @@
+/**
+ * Copyright 2015 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DEVTOOLS_CDBG_DEBUGLETS_PYTHON_CONDITION_MEMO_H_
+#define DEVTOOLS_CDBG_DEBUGLETS_PYTHON_CONDITION_MEMO_H_
+
+#include <vector>
+
+#include "common.h"
+#include "nullable.h"
+#include "python_util.h"
+
+namespace devtools {
+namespace cdbg {
+
+// Memoizes results of a pure breakpoint condition.
+//
+// A condition is pure if it only reads names, uses constants of primitive
+// types and applies operators to them (for example
+// "tenant == 'acme' and region in ('us', 'eu')"). It doesn't call functions
+// and doesn't access attributes. When all the names it reads refer to
+// objects of primitive types (int, long, float, bool, str, unicode or None),
+// the result of the condition is only a function of the values of these
+// objects, so it can be looked up in the cache instead of evaluating the
+// condition again. Evaluating a pure condition on primitive values can't
+// change state of the program, so the cached result is safe to use without
+// the immutability tracer.
+//
+// The cache is small and bounded. Values that aren't primitive (or strings
+// that are too long to be worth keeping alive) disable the cache for the
+// particular hit and the condition is evaluated as usual.
+//
+// All functions must be called with Interpreter Lock held.
+class ConditionMemo {
+ public:
+  // Values of the names read by the condition in a particular frame.
+  struct Key {
+    size_t hash;
+    std::vector<ScopedPyObject> values;
+  };
+
+  // Analyzes the compiled condition. Returns nullptr if the condition is not
+  // pure.
+  static std::unique_ptr<ConditionMemo> Create(PyCodeObject* condition);
+
+  // Reads the values of the names that the condition references in "frame"
+  // the same way the evaluation of the condition would. Returns false if
+  // some name is not defined or some value is not primitive, in which case
+  // the result of the condition can't be memoized.
+  bool BuildKey(PyFrameObject* frame, Key* key) const;
+
+  // Gets the memoized result of the condition for "key" if it's cached.
+  Nullable<bool> Lookup(const Key& key) const;
+
+  // Memoizes the result of the condition for "key".
+  void Store(Key key, bool result);
+
+ private:
+  struct Entry {
+    Key key;
+    bool result;
+  };
+
+  explicit ConditionMemo(std::vector<ScopedPyObject> names);
+
+  // Finds the value of "name" in local variables of "frame". Returns
+  // borrowed reference or nullptr if the name is not a local variable. Sets
+  // "*is_supported" to false if "frame" doesn't support the lookup without
+  // "PyFrame_FastToLocals".
+  static PyObject* LookupLocal(
+      PyFrameObject* frame,
+      PyObject* name,
+      bool* is_supported);
+
+  // Names (in order of appearance) read by the condition.
+  const std::vector<ScopedPyObject> names_;
+
+  // Memoized results of the condition.
+  std::vector<Entry> entries_;
+
+  // Index of the entry to replace when the cache is full.
+  size_t next_victim_;
+
+  DISALLOW_COPY_AND_ASSIGN(ConditionMemo);
+};
+
+}  // namespace cdbg
+}  // namespace devtools
+
+#endif  // DEVTOOLS_CDBG_DEBUGLETS_PYTHON_CONDITION_MEMO_H_
@@ -21,16 +21,23 @@
 
 #include "immutability_tracer.h"
 #include "rate_limit.h"
+#include "request_tag.h"
 
 namespace devtools {
 namespace cdbg {
 
 ConditionalBreakpoint::ConditionalBreakpoint(
     ScopedPyCodeObject condition,
+    ScopedPyObject request_tag,
+    std::unique_ptr<ConditionQuota> condition_quota,
     ScopedPyObject callback)
     : condition_(condition),
+      request_tag_(request_tag),
       python_callback_(callback),
-      per_breakpoint_condition_quota_(CreatePerBreakpointConditionQuota()) {
+      condition_quota_(std::move(condition_quota)) {
+  if (condition_ != nullptr) {
+    condition_memo_ = ConditionMemo::Create(condition_.get());
+  }
 }
 
 
@@ -40,6 +47,10 @@ ConditionalBreakpoint::~ConditionalBreakpoint() {
 
 
 void ConditionalBreakpoint::OnBreakpointHit() {
+  if ((request_tag_ != nullptr) && !IsCurrentRequestTag(request_tag_.get())) {
+    return;
+  }
+
   PyFrameObject* frame = PyThreadState_Get()->frame;
 
   if (!EvaluateCondition(frame)) {
@@ -60,19 +71,35 @@ bool ConditionalBreakpoint::EvaluateCondition(PyFrameObject* frame) {
     return true;
   }
 
+  // Pure conditions are not evaluated again for the same input values. This
+  // also skips "PyFrame_FastToLocals", the immutability tracer and the
+  // condition quota, since nothing is executed.
+  ConditionMemo::Key memo_key;
+  const bool is_memoizable =
+      (condition_memo_ != nullptr) &&
+      condition_memo_->BuildKey(frame, &memo_key);
+  if (is_memoizable) {
+    Nullable<bool> memoized_result = condition_memo_->Lookup(memo_key);
+    if (memoized_result.has_value()) {
+      return memoized_result.value();
+    }
+  }
+
   PyFrame_FastToLocals(frame);
 
   ScopedPyObject result;
   bool is_mutable_code_detected = false;
+  bool is_deadline_exceeded = false;
   int32 line_count = 0;
 
   {
-    ScopedImmutabilityTracer immutability_tracer;
+    ScopedImmutabilityTracer immutability_tracer(ExpressionKind::Condition);
     result.reset(PyEval_EvalCode(
         condition_.get(),
         frame->f_globals,
         frame->f_locals));
     is_mutable_code_detected = immutability_tracer.IsMutableCodeDetected();
+    is_deadline_exceeded = immutability_tracer.IsDeadlineExceeded();
     line_count = immutability_tracer.GetLineCount();
   }
 
@@ -88,12 +115,26 @@ bool ConditionalBreakpoint::EvaluateCondition(PyFrameObject* frame) {
     return false;
   }
 
+  // A condition that doesn't complete within its time limit would slow down
+  // every hit of the breakpoint.
+  if (is_deadline_exceeded) {
+    NotifyBreakpointEvent(
+        BreakpointEvent::BreakpointConditionQuotaExceeded,
+        nullptr);
+    return false;
+  }
+
   if (eval_exception.has_value()) {
     DLOG(INFO) << "Expression evaluation failed: " << eval_exception.value();
     return false;
   }
 
-  if (PyObject_IsTrue(result.get())) {
+  const int is_true = PyObject_IsTrue(result.get());
+  if (is_memoizable && (is_true != -1)) {
+    condition_memo_->Store(std::move(memo_key), is_true == 1);
+  }
+
+  if (is_true) {
     return true;
   }
 
@@ -104,23 +145,36 @@ bool ConditionalBreakpoint::EvaluateCondition(PyFrameObject* frame) {
 
 
 void ConditionalBreakpoint::ApplyConditionQuota(int time_ns) {
-  // Apply global cost limit.
-  if (!GetGlobalConditionQuota()->RequestTokens(time_ns)) {
-    LOG(INFO) << "Global condition quota exceeded";
-    NotifyBreakpointEvent(
-        BreakpointEvent::GlobalConditionQuotaExceeded,
-        nullptr);
+  ConditionQuotaLevel exceeded_level;
+  if (condition_quota_->RequestTokens(time_ns, &exceeded_level)) {
     return;
   }
 
-  // Apply per-breakpoint cost limit.
-  if (!per_breakpoint_condition_quota_->RequestTokens(time_ns)) {
-    LOG(INFO) << "Per breakpoint condition quota exceeded";
-    NotifyBreakpointEvent(
-        BreakpointEvent::BreakpointConditionQuotaExceeded,
-        nullptr);
-    return;
+  BreakpointEvent event;
+  switch (exceeded_level) {
+    case ConditionQuotaLevel::Global:
+      LOG(INFO) << "Global condition quota exceeded";
+      event = BreakpointEvent::GlobalConditionQuotaExceeded;
+      break;
+
+    case ConditionQuotaLevel::Owner:
+      LOG(INFO) << "Per owner condition quota exceeded";
+      event = BreakpointEvent::OwnerConditionQuotaExceeded;
+      break;
+
+    case ConditionQuotaLevel::Module:
+      LOG(INFO) << "Per module condition quota exceeded";
+      event = BreakpointEvent::ModuleConditionQuotaExceeded;
+      break;
+
+    case ConditionQuotaLevel::Breakpoint:
+    default:
+      LOG(INFO) << "Per breakpoint condition quota exceeded";
+      event = BreakpointEvent::BreakpointConditionQuotaExceeded;
+      break;
   }
+
+  NotifyBreakpointEvent(event, nullptr);
 }
 
 
@@ -19,7 +19,9 @@
 
 #include "leaky_bucket.h"
 #include "common.h"
+#include "condition_memo.h"
 #include "python_util.h"
+#include "rate_limit.h"
 
 namespace devtools {
 namespace cdbg {
@@ -42,14 +44,26 @@ enum class BreakpointEvent {
   // The conditional expression changes state of the program and therefore not
   // allowed.
   ConditionExpressionMutable,
+
+  // Conditions of all the breakpoints of the same owner (or in the same
+  // module) are consuming more than their share of resources (see
+  // "ConditionQuota").
+  OwnerConditionQuotaExceeded,
+  ModuleConditionQuotaExceeded,
 };
 
 
 // Implements breakpoint action to evaluate optional breakpoint condition. If
-// the condition matches, calls Python callable object.
+// the condition matches, calls Python callable object. A breakpoint with a
+// request tag (see "request_tag.h") ignores hits on threads with a different
+// tag before evaluating the condition.
 class ConditionalBreakpoint {
  public:
-  ConditionalBreakpoint(ScopedPyCodeObject condition, ScopedPyObject callback);
+  ConditionalBreakpoint(
+      ScopedPyCodeObject condition,
+      ScopedPyObject request_tag,
+      std::unique_ptr<ConditionQuota> condition_quota,
+      ScopedPyObject callback);
 
   ~ConditionalBreakpoint();
 
@@ -61,12 +75,13 @@ class ConditionalBreakpoint {
   // Evaluates breakpoint condition within the context of the specified frame.
   // Returns true if the breakpoint doesn't have condition or if condition
   // was evaluated to True. Otherwise returns false. Raised exceptions are
-  // considered as condition not matched.
+  // considered as condition not matched. Results of pure conditions are
+  // memoized (see "condition_memo.h").
   bool EvaluateCondition(PyFrameObject* frame);
 
   // Takes "time_ns" tokens from the quota for CPU consumption due to breakpoint
-  // condition. If the quota is exceeded, this function clears the breakpoint
-  // and reports "ConditionQuotaExceeded" breakpoint event.
+  // condition. If the quota is exceeded, this function reports the
+  // "ConditionQuotaExceeded" breakpoint event of the level that was exceeded.
   void ApplyConditionQuota(int time_ns);
 
   // Notifies the next layer through the callable object.
@@ -78,12 +93,20 @@ class ConditionalBreakpoint {
   // field will be nullptr.
   ScopedPyCodeObject condition_;
 
+  // Memoized results of the condition or nullptr if the condition is not
+  // pure.
+  std::unique_ptr<ConditionMemo> condition_memo_;
+
+  // Canonical request tag that the thread hitting the breakpoint must have
+  // or nullptr if the breakpoint applies to all threads.
+  ScopedPyObject request_tag_;
+
   // Python callable object to invoke on breakpoint events.
   ScopedPyObject python_callback_;
 
-  // Per breakpoint quota on cost of evaluating breakpoint conditions. See
+  // Hierarchical quota on cost of evaluating breakpoint conditions. See
   // "rate_limit.h" file for detailed explanation.
-  std::unique_ptr<LeakyBucket> per_breakpoint_condition_quota_;
+  std::unique_ptr<ConditionQuota> condition_quota_;
 
   DISALLOW_COPY_AND_ASSIGN(ConditionalBreakpoint);
 };
@@ -14,15 +14,12 @@
 
 """Support for breakpoints on modules that haven't been loaded yet."""
 
-import imp
 import os
 import sys  # Must be imported, otherwise import hooks don't work.
 import time
 
 import cdbg_native as native
-
-# Maximum number of directories that IsValidSourcePath will scan.
-_DIRECTORY_LOOKUP_QUOTA = 250
+import module_catalog
 
 # Callbacks to invoke when a module is imported.
 _import_callbacks = {}
@@ -39,13 +36,9 @@ def IsValidSourcePath(source_path):
 
   There is no absolutely correct way to do this. The application may just
   import a module from a string, or dynamically change sys.path. This function
-  implements heuristics that should cover all reasonable cases with a good
-  performance.
-
-  There can be some edge cases when this code is going to scan a huge number
-  of directories. This can be very expensive. To mitigate it, we limit the
-  number of directories that can be scanned. If this threshold is reached,
-  false negatives are possible.
+  looks up the module name in the catalog of the modules found in sys.path
+  and in the directories of the loaded modules (see module_catalog.py), which
+  should cover all reasonable cases.
 
   Args:
     source_path: source path as specified in the breakpoint.
@@ -54,72 +47,19 @@ def IsValidSourcePath(source_path):
     True if it is possible that a module matching source_path will ever be
     loaded or false otherwise.
   """
-
-  def IsPackage(path):
-    """Checks if the specified directory is a valid Python package."""
-    init_base_path = os.path.join(path, '__init__.py')
-    return (os.path.isfile(init_base_path) or
-            os.path.isfile(init_base_path + 'c') or
-            os.path.isfile(init_base_path + 'o'))
-
-  def SubPackages(path):
-    """Gets a list of all the directories of subpackages of path."""
-    if os.path.isdir(path):
-      for name in os.listdir(path):
-        if '.' in name:
-          continue  # This is definitely a file, package names can't have dots.
-
-        if directory_lookups[0] >= _DIRECTORY_LOOKUP_QUOTA:
-          break
-
-        directory_lookups[0] += 1
-
-        subpath = os.path.join(path, name)
-        if IsPackage(subpath):
-          yield subpath
-
   start_time = time.time()
-  directory_lookups = [0]
 
   file_name = _GetModuleName(source_path)
   if not file_name:
     return False
 
-  # Recursively discover all the subpackages in all the Python paths.
-  paths = set()
-  pending = set(sys.path)
-  while pending:
-    path = pending.pop()
-    paths.add(path)
-    pending |= frozenset(SubPackages(path)) - paths
-
-  # Append all directories where some modules have already been loaded. There
-  # is a good chance that the file we are looking for will be there. This is
-  # only useful if a module got somehow loaded outside of sys.path. We don't
-  # include these paths in the recursive discovery of subpackages because it
-  # takes a lot of time in some edge cases and not worth it.
-  default_path = sys.path[0]
-  for unused_module_name, module in sys.modules.copy().iteritems():
-    file_path = getattr(module, '__file__', None)
-    path, unused_name = os.path.split(file_path) if file_path else (None, None)
-    paths.add(path or default_path)
-
-  try:
-    imp.find_module(file_name, list(paths))
-    rc = True
-  except ImportError:
-    rc = False
+  rc = module_catalog.Contains(file_name)
 
   native.LogInfo(
-      ('Look up for %s completed in %d directories, '
-       'scanned %d directories (quota: %d), '
-       'result: %r, total time: %f ms') % (
-           file_name,
-           len(paths),
-           directory_lookups[0],
-           _DIRECTORY_LOOKUP_QUOTA,
-           rc,
-           (time.time() - start_time) * 1000))
+      'Look up for %s completed, result: %r, total time: %f ms' % (
+          file_name,
+          rc,
+          (time.time() - start_time) * 1000))
   return rc
 
 
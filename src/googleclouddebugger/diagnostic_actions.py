@@ -0,0 +1,359 @@
+# Copyright 2015 Google Inc. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS-IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Diagnostic actions that run in place of a source location breakpoint.
+
+A breakpoint with one of the diagnostic actions ("PROFILE" or "HEAP_CENSUS")
+is not set at any source location. It goes through BreakpointsManager like any
+other breakpoint: it starts when the breakpoint becomes active, reports its
+result through the breakpoint update channel and completes.
+"""
+
+from datetime import datetime
+from datetime import timedelta
+import threading
+
+import cdbg_native as native
+
+PROFILE_ALREADY_RUNNING = (
+    'Another profiling session is already running')
+INVALID_PARAMETER = (
+    'Invalid value of $0')
+PROFILE_COLLECTED = (
+    'Collected $0 samples in $1 seconds')
+PROFILE_TRUNCATED = (
+    'Collected $0 samples in $1 seconds. Only the most frequent stacks are '
+    'included ($2 samples omitted)')
+HEAP_CENSUS_COLLECTED = (
+    'Counted $0 objects ($1 bytes)')
+HEAP_CENSUS_TRUNCATED = (
+    'Counted $0 objects ($1 bytes). The census was stopped early, the '
+    'remaining objects were not counted')
+ACTION_EXPIRED = (
+    'The diagnostic action has expired')
+
+# Default and maximum profiling duration.
+DEFAULT_PROFILE_DURATION_SEC = 10
+MAX_PROFILE_DURATION_SEC = 300
+
+# Default and maximum number of samples per second.
+DEFAULT_SAMPLING_RATE_HZ = 100
+MAX_SAMPLING_RATE_HZ = 1000
+
+# Maximum size of collapsed stacks sent in the breakpoint update.
+MAX_PROFILE_SIZE = 256 * 1024
+
+# Default and maximum number of types reported by the heap census.
+DEFAULT_HEAP_CENSUS_TYPES = 20
+MAX_HEAP_CENSUS_TYPES = 100
+
+# Limits of a single heap census. The census runs with the Interpreter Lock
+# held, so these limits bound the pause of the application. They don't bound
+# the list of all the objects tracked by the garbage collector that the
+# census starts with: memory usage transiently grows by a pointer per tracked
+# object regardless of these limits.
+_MAX_CENSUS_OBJECTS = 1000000
+_MAX_CENSUS_TIME_SEC = 0.5
+
+
+def IsDiagnosticAction(definition):
+  """Returns True if the breakpoint definition is a diagnostic action."""
+  return definition.get('action') in _ACTIONS
+
+
+def CreateDiagnosticAction(definition, hub_client, breakpoints_manager):
+  """Creates and starts the diagnostic action of the breakpoint.
+
+  Args:
+    definition: breakpoint definition as it came from the backend.
+    hub_client: asynchronously sends breakpoint updates to the backend.
+    breakpoints_manager: parent object managing active breakpoints.
+
+  Returns:
+    Object with the same interface that BreakpointsManager uses on
+    PythonBreakpoint.
+  """
+  return _ACTIONS[definition['action']](
+      definition, hub_client, breakpoints_manager)
+
+
+class _DiagnosticAction(object):
+  """Common code of all diagnostic actions."""
+
+  def __init__(self, definition, hub_client, breakpoints_manager):
+    self.definition = definition
+
+    # Action expiration time.
+    self.expiration_period = timedelta(hours=24)
+
+    self._hub_client = hub_client
+    self._breakpoints_manager = breakpoints_manager
+    self._lock = threading.Lock()
+    self._completed = False
+
+  def GetBreakpointId(self):
+    return self.definition['id']
+
+  def GetExpirationTime(self):
+    """Computes the timestamp at which this action will expire."""
+    create_datetime = datetime.strptime(
+        self.definition['createTime'].replace('Z', 'UTC'),
+        '%Y-%m-%dT%H:%M:%S.%f%Z')
+    return create_datetime + self.expiration_period
+
+  def ExpireBreakpoint(self):
+    """Expires this action."""
+    if not self._SetCompleted():
+      return
+
+    self._Cancel()
+    self._CompleteWithError('UNSPECIFIED', ACTION_EXPIRED)
+
+  def Clear(self):
+    """Cancels the action if it hasn't completed yet.
+
+    This function is assumed to be called by BreakpointsManager. Therefore we
+    don't call CompleteBreakpoint from here.
+    """
+    if self._SetCompleted():
+      self._Cancel()
+
+  def _Cancel(self):
+    """Releases resources of an action that didn't complete."""
+    pass
+
+  def _GetIntParameter(self, parameters, name, default, max_value):
+    """Reads an optional integer parameter of the action.
+
+    Returns:
+      Parameter value or None if the value is invalid (in which case the
+      action is completed with an error).
+    """
+    value = parameters.get(name, default)
+    if (not isinstance(value, (int, long)) or isinstance(value, bool) or
+        value <= 0 or value > max_value):
+      self._SetCompleted()
+      self._CompleteWithError(
+          'UNSPECIFIED', INVALID_PARAMETER, [name])
+      return None
+
+    return value
+
+  def _CompleteWithError(self, refers_to, message, parameters=None):
+    self._Complete({
+        'status': {
+            'isError': True,
+            'refersTo': refers_to,
+            'description': {
+                'format': message,
+                'parameters': parameters or []}}})
+
+  def _Complete(self, data):
+    """Sends the final breakpoint update and deactivates the action."""
+    data = dict(self.definition, **data)
+    data['isFinalState'] = True
+
+    try:
+      self._hub_client.EnqueueBreakpointUpdate(data)
+    finally:
+      self._breakpoints_manager.CompleteBreakpoint(self.GetBreakpointId())
+
+  def _SetCompleted(self):
+    """Atomically marks the action as completed.
+
+    Returns:
+      True if the action wasn't marked already completed or False if the
+      action was already completed.
+    """
+    with self._lock:
+      if self._completed:
+        return False
+      self._completed = True
+      return True
+
+
+class ProfileAction(_DiagnosticAction):
+  """Samples call stacks of all Python threads for a bounded duration.
+
+  The profile is reported as a single "collapsedStacks" evaluated expression
+  in the collapsed stack format, which flame graph tools accept directly:
+      outer (file.py:10);inner (file.py:20) 17
+
+  Optional parameters come in the "profile" field of the definition:
+    durationSec: how long to sample.
+    samplingRateHz: number of samples per second.
+    mode: "cpu" (default) only samples threads that are running, "wall"
+        samples all threads including the blocked ones.
+  """
+
+  def __init__(self, definition, hub_client, breakpoints_manager):
+    super(ProfileAction, self).__init__(
+        definition, hub_client, breakpoints_manager)
+    self._timer = None
+
+    parameters = definition.get('profile') or {}
+
+    self._duration_sec = self._GetIntParameter(
+        parameters, 'durationSec',
+        DEFAULT_PROFILE_DURATION_SEC, MAX_PROFILE_DURATION_SEC)
+    if self._duration_sec is None:
+      return
+
+    sampling_rate_hz = self._GetIntParameter(
+        parameters, 'samplingRateHz',
+        DEFAULT_SAMPLING_RATE_HZ, MAX_SAMPLING_RATE_HZ)
+    if sampling_rate_hz is None:
+      return
+
+    mode = parameters.get('mode', 'cpu')
+    if mode not in ('cpu', 'wall'):
+      self._SetCompleted()
+      self._CompleteWithError('UNSPECIFIED', INVALID_PARAMETER, ['mode'])
+      return
+
+    if not native.StartProfiler(
+        sampling_rate_hz, self._duration_sec, mode == 'cpu'):
+      self._SetCompleted()
+      self._CompleteWithError('UNSPECIFIED', PROFILE_ALREADY_RUNNING)
+      return
+
+    native.LogInfo('Profiling for %d seconds at %d Hz (breakpoint %s)' % (
+        self._duration_sec, sampling_rate_hz, self.GetBreakpointId()))
+
+    # Sampling stops by itself after the duration elapses. The timer collects
+    # the results.
+    self._timer = threading.Timer(self._duration_sec, self._Finish)
+    self._timer.daemon = True
+    self._timer.start()
+
+  def _Cancel(self):
+    if self._timer is not None:
+      self._timer.cancel()
+    native.StopProfiler()
+
+  def _Finish(self):
+    """Collects the profile and completes the action."""
+    if not self._SetCompleted():
+      return
+
+    sample_count, collapsed_stacks = native.StopProfiler()
+    collapsed_stacks, omitted_samples = _TruncateStacks(collapsed_stacks)
+
+    if omitted_samples:
+      description = {
+          'format': PROFILE_TRUNCATED,
+          'parameters': [str(sample_count), str(self._duration_sec),
+                         str(omitted_samples)]}
+    else:
+      description = {
+          'format': PROFILE_COLLECTED,
+          'parameters': [str(sample_count), str(self._duration_sec)]}
+
+    self._Complete({
+        'status': {
+            'isError': False,
+            'refersTo': 'UNSPECIFIED',
+            'description': description},
+        'evaluatedExpressions': [
+            {'name': 'collapsedStacks', 'value': collapsed_stacks}]})
+
+
+class HeapCensusAction(_DiagnosticAction):
+  """Counts live objects and their approximate sizes per type.
+
+  Each of the top types is reported as an evaluated expression named after
+  the type with "count" and "size" members. Sizes are shallow (see
+  heap_census.h), so a type holding a large amount of memory through
+  references appears small, while the referenced objects are counted under
+  their own types.
+
+  Optional parameters come in the "heapCensus" field of the definition:
+    topTypes: number of types with the largest total size to report.
+  """
+
+  def __init__(self, definition, hub_client, breakpoints_manager):
+    super(HeapCensusAction, self).__init__(
+        definition, hub_client, breakpoints_manager)
+
+    parameters = definition.get('heapCensus') or {}
+
+    self._top_types = self._GetIntParameter(
+        parameters, 'topTypes',
+        DEFAULT_HEAP_CENSUS_TYPES, MAX_HEAP_CENSUS_TYPES)
+    if self._top_types is None:
+      return
+
+    # Don't hold the lock of BreakpointsManager during the census.
+    thread = threading.Thread(target=self._Run)
+    thread.name = 'Cloud Debugger heap census'
+    thread.daemon = True
+    thread.start()
+
+  def _Run(self):
+    """Takes the census and completes the action."""
+    object_count, total_size, truncated, top_types = native.TakeHeapCensus(
+        _MAX_CENSUS_OBJECTS, _MAX_CENSUS_TIME_SEC, self._top_types)
+
+    if not self._SetCompleted():
+      return  # Cleared while the census was running.
+
+    self._Complete({
+        'status': {
+            'isError': False,
+            'refersTo': 'UNSPECIFIED',
+            'description': {
+                'format': (HEAP_CENSUS_TRUNCATED if truncated
+                           else HEAP_CENSUS_COLLECTED),
+                'parameters': [str(object_count), str(total_size)]}},
+        'evaluatedExpressions': [
+            {'name': name,
+             'members': [
+                 {'name': 'count', 'value': str(count), 'type': 'int'},
+                 {'name': 'size', 'value': str(size), 'type': 'int'}]}
+            for name, count, size in top_types]})
+
+
+def _TruncateStacks(collapsed_stacks):
+  """Keeps the most frequent stacks that fit into MAX_PROFILE_SIZE.
+
+  Returns:
+    Tuple of the collapsed stacks (most frequent first if truncated) and the
+    number of omitted samples.
+  """
+  if len(collapsed_stacks) <= MAX_PROFILE_SIZE:
+    return collapsed_stacks, 0
+
+  lines = [line.rsplit(' ', 1) for line in collapsed_stacks.splitlines()]
+  lines.sort(key=lambda line: int(line[1]), reverse=True)
+
+  kept = []
+  size = 0
+  omitted_samples = 0
+  for stack, count in lines:
+    line = '%s %s\n' % (stack, count)
+    if size + len(line) > MAX_PROFILE_SIZE:
+      omitted_samples += int(count)
+      continue
+
+    kept.append(line)
+    size += len(line)
+
+  return ''.join(kept), omitted_samples
+
+
+# Map of action names to classes implementing them.
+_ACTIONS = {
+    'PROFILE': ProfileAction,
+    'HEAP_CENSUS': HeapCensusAction
+}
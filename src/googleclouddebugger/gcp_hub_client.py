@@ -14,7 +14,6 @@
 
 """Communicates with Cloud Debugger backend over HTTP."""
 
-from collections import deque
 import copy
 import hashlib
 import inspect
@@ -25,17 +24,21 @@ import sys
 import threading
 import time
 import traceback
+import zlib
 
 
 
 import apiclient
 from apiclient import discovery  # pylint: disable=unused-import
+from apiclient import model
 from backoff import Backoff
 import httplib2
 import oauth2client
 from oauth2client.contrib.gce import AppAssertionCredentials
 
 import cdbg_native as native
+import transmission_queue
+from transmission_spool import TransmissionSpool
 import uniquifier_computer
 import googleclouddebugger
 
@@ -48,6 +51,10 @@ import googleclouddebugger
 # API scope we are requesting when service account authentication is enabled.
 _CLOUD_PLATFORM_SCOPE = 'https://www.googleapis.com/auth/cloud-platform'
 
+# Discovery document of the Cloud Debugger API.
+_DISCOVERY_URL = (
+    'https://www.googleapis.com/discovery/v1/apis/clouddebugger/v2/rest')
+
 # Base URL for metadata service. Specific attributes are appended to this URL.
 _LOCAL_METADATA_SERVICE_PROJECT_URL = ('http://metadata.google.internal/'
                                        'computeMetadata/v1/project/')
@@ -64,6 +71,59 @@ _DEBUGGEE_LABELS = {
 # version is excluded for the sake of consistency with AppEngine UX.
 _DESCRIPTION_LABELS = ['projectid', 'module', 'version']
 
+# Supported content encodings of breakpoint update requests. The value is the
+# zlib window bits parameter that selects the matching container format.
+_UPLOAD_ENCODINGS = {
+    'gzip': 16 + zlib.MAX_WBITS,
+    'deflate': zlib.MAX_WBITS}
+
+# Default minimal size of a breakpoint update request to be compressed.
+DEFAULT_UPLOAD_COMPRESSION_MIN_SIZE = 8 * 1024
+
+
+class _SerializedJsonModel(model.JsonModel):
+  """JSON model that sends already serialized request bodies as is."""
+
+  def serialize(self, body_value):
+    if isinstance(body_value, basestring):
+      return body_value
+    return super(_SerializedJsonModel, self).serialize(body_value)
+
+
+def _EncodeJson(body):
+  """Serializes the request body into a JSON string.
+
+  The native encoder escapes strings with the Interpreter Lock released. It
+  only supports the types produced by the capture collector, so anything
+  else falls back to the json module.
+
+  Args:
+    body: dictionary to serialize.
+
+  Returns:
+    JSON string.
+  """
+  try:
+    return native.EncodeJson(body)
+  except TypeError:
+    return json.dumps(body, default=_DecodeJsonFragment)
+
+
+def _DecodeJsonFragment(obj):
+  """Converts native.CreateJsonFragment object back for the json module.
+
+  Args:
+    obj: object that the json module can't serialize.
+
+  Returns:
+    Decoded content of the fragment.
+
+  Raises:
+    TypeError: "obj" is not a JSON fragment.
+  """
+  # Top level fragment is encoded by the native encoder as is.
+  return json.loads(native.EncodeJson(obj))
+
 
 class GcpHubClient(object):
   """Controller API client.
@@ -83,6 +143,7 @@ class GcpHubClient(object):
   def __init__(self):
     self.on_active_breakpoints_changed = lambda x: None
     self.on_idle = lambda: None
+    self._pid = os.getpid()
     self._debuggee_labels = {}
     self._service_account_auth = False
     self._debuggee_id = None
@@ -91,9 +152,24 @@ class GcpHubClient(object):
     self._main_thread = None
     self._transmission_thread = None
     self._transmission_thread_startup_lock = threading.Lock()
-    self._transmission_queue = deque(maxlen=100)
+    self._transmission_queue = transmission_queue.TransmissionQueue()
+    self._transmission_spool = None
+    # Number of unexpected errors sending the first record of the spool.
+    self._spool_head_failures = 0
+    self._upload_encoding = None
+    self._upload_compression_min_size = DEFAULT_UPLOAD_COMPRESSION_MIN_SIZE
     self._new_updates = threading.Event(False)
 
+    # Discovery document of the API. Fetched when the service is built for
+    # the first time and reused when reconnecting.
+    self._discovery_document = None
+
+    # Authorized httplib2.Http object of each worker thread (attribute
+    # "http"). httplib2.Http is not thread safe, so threads can't share it,
+    # but each thread keeps its keep-alive connection and access token across
+    # service rebuilds.
+    self._thread_http = threading.local()
+
     # Disable logging in the discovery API to avoid excessive logging.
     class _ChildLogFilter(logging.Filter):
       """Filter to eliminate info-level logging when called from this module."""
@@ -129,6 +205,9 @@ class GcpHubClient(object):
     # is assumed to be poisonous and discarded
     self.max_transmit_attempts = 10
 
+    # zlib compression level of breakpoint update requests.
+    self.upload_compression_level = 6
+
   def InitializeDebuggeeLabels(self, flags):
     """Initialize debuggee labels from environment variables and flags.
 
@@ -188,6 +267,43 @@ class GcpHubClient(object):
     self._project_id = lambda: self._QueryGcpProject('project-id')
     self._project_number = lambda: self._QueryGcpProject('numeric-project-id')
 
+  def EnableTransmissionSpool(self, path, max_size):
+    """Spills pending breakpoint updates to a file during backend outages.
+
+    Without the spool, pending updates are kept in memory and discarded after
+    max_transmit_attempts transient failures. With the spool, updates that
+    failed to transmit or didn't fit into the in-memory queue are moved to
+    the spool file. They are retried once the backend becomes reachable. This
+    keeps memory usage flat regardless of how long the outage is.
+
+    Args:
+      path: path of the spool file.
+      max_size: maximum size of the spool file in bytes.
+    """
+    try:
+      self._transmission_spool = TransmissionSpool(path, max_size)
+    except (IOError, OSError, ValueError) as e:
+      native.LogWarning(
+          'Failed to open transmission spool %s, spooling disabled: %s' % (
+              path, e))
+
+  def EnableUploadCompression(self, encoding, min_size):
+    """Compresses large breakpoint update requests.
+
+    Compression happens on the transmission thread right before each attempt
+    to send the update. zlib releases the Interpreter Lock while compressing.
+
+    Args:
+      encoding: content encoding to use ('gzip' or 'deflate').
+      min_size: smaller request bodies are sent uncompressed.
+    """
+    if encoding not in _UPLOAD_ENCODINGS:
+      native.LogWarning('Unsupported upload compression %s' % encoding)
+      return
+
+    self._upload_encoding = encoding
+    self._upload_compression_min_size = min_size
+
   def Start(self):
     """Starts the worker thread."""
     self._shutdown = False
@@ -197,6 +313,10 @@ class GcpHubClient(object):
     self._main_thread.daemon = True
     self._main_thread.start()
 
+    if self._transmission_spool:
+      # Send updates left over from the previous run.
+      self._StartTransmissionThread()
+
   def Stop(self):
     """Signals the worker threads to shut down and waits until it exits."""
     self._shutdown = True
@@ -210,6 +330,34 @@ class GcpHubClient(object):
       self._transmission_thread.join()
       self._transmission_thread = None
 
+  def AfterFork(self):
+    """Restarts the worker threads in a forked child process.
+
+    Threads don't survive fork. The child process keeps the registered
+    debuggee ID and the list of active breakpoints, so it doesn't need to
+    register again. Pending updates belong to the parent process, which will
+    send them. The transmission spool is not used in the child process,
+    because the spool file can't be shared by two processes (the parent
+    process keeps the spool file locked).
+    """
+    if self._pid == os.getpid():
+      return  # Not a forked process or already reinitialized.
+
+    self._pid = os.getpid()
+    self._main_thread = None
+    self._transmission_thread = None
+    self._transmission_thread_startup_lock = threading.Lock()
+    self._transmission_queue = transmission_queue.TransmissionQueue(
+        self._transmission_queue.max_bytes)
+    if self._transmission_spool is not None:
+      self._transmission_spool.DetachAfterFork()
+      self._transmission_spool = None
+    self._new_updates = threading.Event(False)
+    self._wait_token = 'init'
+    self._thread_http = threading.local()
+
+    self.Start()
+
   def EnqueueBreakpointUpdate(self, breakpoint):
     """Asynchronously updates the specified breakpoint on the backend.
 
@@ -217,9 +365,44 @@ class GcpHubClient(object):
     all the work. The worker thread is responsible to retry the transmission
     in case of transient errors.
 
+    The update is serialized right away. Pending updates are kept in a
+    queue ordered by priority (see transmission_queue.py). A newer update of
+    the same breakpoint supersedes the pending one. If the queue exceeds its
+    byte budget, the least important updates are moved to the transmission
+    spool or dropped.
+
     Args:
       breakpoint: breakpoint in either final or non-final state.
     """
+    if self._pid != os.getpid():
+      # The process was forked without going through os.fork (for example
+      # by a server written in C).
+      googleclouddebugger.AfterFork()
+
+    self._StartTransmissionThread()
+
+    item = transmission_queue.TransmissionItem(
+        breakpoint['id'],
+        transmission_queue.GetPriority(breakpoint),
+        bool(breakpoint.get('isFinalState')),
+        _EncodeJson({'breakpoint': breakpoint}))
+    self._SpoolOrDrop(self._transmission_queue.Push(item))
+    self._new_updates.set()  # Wake up the worker thread to send immediately.
+
+  def GetMemoryUsage(self):
+    """Returns the number of bytes used by pending breakpoint updates."""
+    return self._transmission_queue.total_bytes()
+
+  def ReleaseMemory(self):
+    """Moves pending non-final breakpoint updates out of memory.
+
+    Non-final updates are superseded by the final ones anyway. They are
+    spooled if the transmission spool is enabled and dropped otherwise.
+    """
+    self._SpoolOrDrop(self._transmission_queue.EvictInterim())
+
+  def _StartTransmissionThread(self):
+    """Lazily starts the transmission thread."""
     with self._transmission_thread_startup_lock:
       if self._transmission_thread is None:
         self._transmission_thread = threading.Thread(
@@ -228,19 +411,76 @@ class GcpHubClient(object):
         self._transmission_thread.daemon = True
         self._transmission_thread.start()
 
-    self._transmission_queue.append((breakpoint, 0))
-    self._new_updates.set()  # Wake up the worker thread to send immediately.
+  def _SpoolOrDrop(self, items):
+    """Moves breakpoint updates to the transmission spool if enabled.
 
-  def _BuildService(self):
-    http = httplib2.Http()
-    http = self._credentials.authorize(http)
+    Spool records are formatted as breakpoint ID and request body separated
+    by a new line character.
+
+    Args:
+      items: list of TransmissionItem objects that can't be kept in memory.
+    """
+    for item in items:
+      if self._transmission_spool is None:
+        native.LogWarning(
+            'Transmission queue is full, breakpoint %s update dropped' % (
+                item.breakpoint_id))
+      elif not self._transmission_spool.Append(
+          '%s\n%s' % (item.breakpoint_id, item.body)):
+        native.LogWarning(
+            'Transmission spool is full, breakpoint %s update dropped' % (
+                item.breakpoint_id))
+
+  def _BuildService(self, discard_connections=False):
+    """Creates API client on top of the HTTP connection of this thread.
+
+    Each worker thread has its own httplib2.Http object, since HTTP
+    connections can't be shared between threads. The object is created on
+    the first call and reused by all the clients the thread builds later, so
+    rebuilding the client (for example on every registration attempt) keeps
+    the established connection.
+
+    Args:
+      discard_connections: if True, closes the open connections of this
+          thread before building the client. Used after unexpected errors
+          that might have left the connection in a bad state.
+
+    Returns:
+      Controller API client.
+    """
+    http = getattr(self._thread_http, 'http', None)
+    if http is None:
+      http = self._credentials.authorize(httplib2.Http())
+      self._thread_http.http = http
+    elif discard_connections:
+      for connection in http.connections.values():
+        connection.close()
+      http.connections.clear()
+
+    discovery_document = self._discovery_document
+    if discovery_document is None:
+      response, discovery_document = http.request(_DISCOVERY_URL)
+      if response.status >= 400:
+        raise apiclient.errors.HttpError(
+            response, discovery_document, uri=_DISCOVERY_URL)
+
+    api = apiclient.discovery.build_from_document(
+        discovery_document,
+        http=http,
+        model=_SerializedJsonModel())
+
+    # Only cache the document once it has been parsed successfully.
+    self._discovery_document = discovery_document
 
-    api = apiclient.discovery.build('clouddebugger', 'v2', http=http)
     return api.controller()
 
   def _MainThreadProc(self):
     """Entry point for the worker thread."""
-    registration_required = True
+    # The debuggee is already registered if the process was forked.
+    registration_required = self._debuggee_id is None
+    if not registration_required:
+      service = self._BuildService()
+
     while not self._shutdown:
       if registration_required:
         service = self._BuildService()
@@ -263,7 +503,7 @@ class GcpHubClient(object):
       self._new_updates.clear()
 
       if reconnect:
-        service = self._BuildService()
+        service = self._BuildService(discard_connections=True)
         reconnect = False
 
       reconnect, delay = self._TransmitBreakpointUpdates(service)
@@ -343,13 +583,16 @@ class GcpHubClient(object):
   def _TransmitBreakpointUpdates(self, service):
     """Tries to send pending breakpoint updates to the backend.
 
-    Sends all the pending breakpoint updates. In case of transient failures,
-    the breakpoint is inserted back to the top of the queue. Application
-    failures are not retried (for example updating breakpoint in a final
-    state).
+    Sends all the pending breakpoint updates in priority order. In case of
+    transient failures, the breakpoint is inserted back to the queue.
+    Application failures are not retried (for example updating breakpoint in
+    a final state).
 
     Each pending breakpoint maintains a retry counter. After repeated transient
-    failures the breakpoint is discarded and dropped from the queue.
+    failures the breakpoint is discarded and dropped from the queue. If the
+    transmission spool is enabled, the breakpoint is moved to the spool
+    instead. Spooled updates are only sent once all in-memory updates went
+    through.
 
     Args:
       service: client to use for API calls
@@ -364,48 +607,146 @@ class GcpHubClient(object):
     reconnect = False
     retry_list = []
 
-    # There is only one consumer, so two step pop is safe.
-    while self._transmission_queue:
-      breakpoint, retry_count = self._transmission_queue.popleft()
-
-      try:
-        service.debuggees().breakpoints().update(
-            debuggeeId=self._debuggee_id, id=breakpoint['id'],
-            body={'breakpoint': breakpoint}).execute()
-
-        native.LogInfo('Breakpoint %s update transmitted successfully' % (
-            breakpoint['id']))
-      except apiclient.errors.HttpError as err:
-        # Treat 400 error codes (except timeout) as application error that will
-        # not be retried. All other errors are assumed to be transient.
-        status = err.resp.status
-        is_transient = ((status >= 500) or (status == 408))
-        if is_transient and retry_count < self.max_transmit_attempts - 1:
-          native.LogInfo('Failed to send breakpoint %s update: %s' % (
-              breakpoint['id'], traceback.format_exc()))
-          retry_list.append((breakpoint, retry_count + 1))
-        elif is_transient:
-          native.LogWarning(
-              'Breakpoint %s retry count exceeded maximum' % breakpoint['id'])
-        else:
-          # This is very common if multiple instances are sending final update
-          # simultaneously.
-          native.LogInfo('%s, breakpoint: %s' % (err, breakpoint['id']))
-      except Exception:
+    while True:
+      item = self._transmission_queue.Pop()
+      if item is None:
+        break
+
+      is_transient, is_fatal = self._TransmitBreakpointUpdate(
+          service, item.breakpoint_id, item.body)
+      reconnect |= is_fatal
+      if not is_transient:
+        continue
+
+      if self._transmission_spool is not None:
+        self._SpoolOrDrop([item])
+      elif is_fatal:
+        continue  # Only retried if the update can be spooled.
+      elif item.retry_count < self.max_transmit_attempts - 1:
+        item.retry_count += 1
+        retry_list.append(item)
+      else:
         native.LogWarning(
-            'Fatal error sending breakpoint %s update: %s' % (
-                breakpoint['id'], traceback.format_exc()))
-        reconnect = True
+            'Breakpoint %s retry count exceeded maximum' % item.breakpoint_id)
+
+    for item in retry_list:
+      self._SpoolOrDrop(self._transmission_queue.Requeue(item))
 
-    self._transmission_queue.extend(retry_list)
+    if not self._transmission_queue and not reconnect:
+      reconnect = self._DrainTransmissionSpool(service)
 
-    if not self._transmission_queue:
+    if (not self._transmission_queue and
+        not self._transmission_spool):  # None or empty.
       self.update_backoff.Succeeded()
       # Nothing to send, wait until next breakpoint update.
       return (reconnect, None)
     else:
       return (reconnect, self.update_backoff.Failed())
 
+  def _DrainTransmissionSpool(self, service):
+    """Sends breakpoint updates from the spool until the first failure.
+
+    Application errors (like an update of a breakpoint that the backend has
+    already deleted) drop the record just like for updates that are sent
+    directly. A record that fails with an unexpected error is retried up to
+    max_transmit_attempts times and then dropped, so that it doesn't block
+    the records behind it forever.
+
+    Args:
+      service: client to use for API calls
+
+    Returns:
+      True if the caller should discard the HTTP connection.
+    """
+    if self._transmission_spool is None or self._debuggee_id is None:
+      return False
+
+    while True:
+      data = self._transmission_spool.Peek()
+      if data is None:
+        return False
+
+      if '\n' not in data:
+        native.LogWarning('Discarding malformed spooled breakpoint update')
+        self._transmission_spool.Pop()
+        self._spool_head_failures = 0
+        continue
+
+      breakpoint_id, body = data.split('\n', 1)
+      is_transient, is_fatal = self._TransmitBreakpointUpdate(
+          service, breakpoint_id, body)
+      if is_fatal:
+        self._spool_head_failures += 1
+        if self._spool_head_failures < self.max_transmit_attempts:
+          return True
+
+        native.LogWarning(
+            'Discarding spooled breakpoint %s update after %d failures' % (
+                breakpoint_id, self._spool_head_failures))
+      elif is_transient:
+        return False
+
+      self._transmission_spool.Pop()
+      self._spool_head_failures = 0
+
+  def _TransmitBreakpointUpdate(self, service, breakpoint_id, body):
+    """Single attempt to send a breakpoint update to the backend.
+
+    Args:
+      service: client to use for API calls
+      breakpoint_id: ID of the updated breakpoint.
+      body: serialized request body.
+
+    Returns:
+      (is_transient, is_fatal) tuple. The first element is set to true if the
+      update failed and should be retried. The second element is set to true
+      on unexpected errors, in which case the HTTP connection should be
+      discarded and the update is retried.
+    """
+    try:
+      request = service.debuggees().breakpoints().update(
+          debuggeeId=self._debuggee_id, id=breakpoint_id, body=body)
+      self._CompressRequestBody(request)
+      request.execute()
+
+      native.LogInfo('Breakpoint %s update transmitted successfully' % (
+          breakpoint_id))
+      return (False, False)
+    except apiclient.errors.HttpError as err:
+      # Treat 400 error codes (except timeout) as application error that will
+      # not be retried. All other errors are assumed to be transient.
+      status = err.resp.status
+      if (status >= 500) or (status == 408):
+        native.LogInfo('Failed to send breakpoint %s update: %s' % (
+            breakpoint_id, traceback.format_exc()))
+        return (True, False)
+
+      # This is very common if multiple instances are sending final update
+      # simultaneously.
+      native.LogInfo('%s, breakpoint: %s' % (err, breakpoint_id))
+      return (False, False)
+    except Exception:
+      native.LogWarning(
+          'Fatal error sending breakpoint %s update: %s' % (
+              breakpoint_id, traceback.format_exc()))
+      return (True, True)
+
+  def _CompressRequestBody(self, request):
+    """Compresses the body of the HTTP request if compression is enabled."""
+    if ((self._upload_encoding is None) or
+        (len(request.body) < self._upload_compression_min_size)):
+      return
+
+    compressor = zlib.compressobj(
+        self.upload_compression_level,
+        zlib.DEFLATED,
+        _UPLOAD_ENCODINGS[self._upload_encoding])
+    body = compressor.compress(request.body) + compressor.flush()
+
+    request.body = body
+    request.body_size = len(body)
+    request.headers['content-encoding'] = self._upload_encoding
+
   def _QueryGcpProject(self, resource):
     """Queries project resource on a local metadata service."""
     url = _LOCAL_METADATA_SERVICE_PROJECT_URL + resource
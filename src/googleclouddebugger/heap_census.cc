@@ -0,0 +1,231 @@
+/**
+ * Copyright 2015 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Ensure that Python.h is included before any other header.
+#include "common.h"
+
+#include "heap_census.h"
+
+#include <time.h>
+
+#include <algorithm>
+
+namespace devtools {
+namespace cdbg {
+
+// Number of objects counted between checks of the wall clock budget.
+static const int64 kTimeCheckInterval = 256;
+
+
+static int64 GetMonotonicTimeNs() {
+  timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec * 1000000000LL + time.tv_nsec;
+}
+
+
+// Computes shallow size of the object including the storage it owns
+// directly.
+static int64 ApproximateSize(PyObject* obj) {
+  int64 size = GetShallowObjectSize(obj);
+
+  if (PyList_Check(obj)) {
+    size += reinterpret_cast<PyListObject*>(obj)->allocated *
+            sizeof(PyObject*);
+  } else if (PyDict_Check(obj)) {
+    PyDictObject* dict = reinterpret_cast<PyDictObject*>(obj);
+    if (dict->ma_table != dict->ma_smalltable) {
+      size += (dict->ma_mask + 1) * sizeof(PyDictEntry);
+    }
+  } else if (PyAnySet_Check(obj)) {
+    PySetObject* set = reinterpret_cast<PySetObject*>(obj);
+    if (set->table != set->smalltable) {
+      size += (set->mask + 1) * sizeof(setentry);
+    }
+  } else if (PyUnicode_Check(obj)) {
+    size += (PyUnicode_GET_SIZE(obj) + 1) * sizeof(Py_UNICODE);
+  }
+
+  return size;
+}
+
+
+// Formats the name of a type (or of an old style class) qualified with the
+// module name for classes defined in Python code.
+static string GetTypeName(PyObject* type_key) {
+  const char* name = nullptr;
+  PyObject* module = nullptr;
+
+  if (PyClass_Check(type_key)) {
+    PyClassObject* cls = reinterpret_cast<PyClassObject*>(type_key);
+    name = PyString_AsString(cls->cl_name);
+    module = PyDict_GetItemString(cls->cl_dict, "__module__");
+  } else {
+    PyTypeObject* type = reinterpret_cast<PyTypeObject*>(type_key);
+    name = type->tp_name;
+    if ((type->tp_flags & Py_TPFLAGS_HEAPTYPE) && (type->tp_dict != nullptr)) {
+      module = PyDict_GetItemString(type->tp_dict, "__module__");
+    }
+  }
+
+  if (name == nullptr) {
+    PyErr_Clear();
+    name = "<unknown>";
+  }
+
+  if ((module == nullptr) || !PyString_Check(module)) {
+    return name;
+  }
+
+  return string(PyString_AS_STRING(module)) + '.' + name;
+}
+
+
+HeapCensus::HeapCensus(int64 max_objects, int64 max_time_ns)
+    : max_objects_(max_objects),
+      max_time_ns_(max_time_ns),
+      start_time_ns_(0),
+      object_count_(0),
+      total_size_(0),
+      truncated_(false) {
+}
+
+
+bool HeapCensus::Run() {
+  start_time_ns_ = GetMonotonicTimeNs();
+
+  ScopedPyObject gc_module(PyImport_ImportModule("gc"));
+  if (gc_module == nullptr) {
+    return false;
+  }
+
+  ScopedPyObject objects(
+      PyObject_CallMethod(gc_module.get(), const_cast<char*>("get_objects"),
+                          nullptr));
+  if (objects == nullptr) {
+    return false;
+  }
+
+  if (!PyList_Check(objects.get())) {
+    PyErr_SetString(PyExc_TypeError, "gc.get_objects must return a list");
+    return false;
+  }
+
+  const Py_ssize_t size = PyList_GET_SIZE(objects.get());
+  for (Py_ssize_t i = 0; (i < size) && !truncated_; ++i) {
+    PyObject* obj = PyList_GET_ITEM(objects.get(), i);
+    if (obj == objects.get()) {
+      continue;  // Don't count the list we have just created.
+    }
+
+    if (!CountObject(obj)) {
+      break;
+    }
+
+    traverseproc traverse = Py_TYPE(obj)->tp_traverse;
+    if (traverse != nullptr) {
+      traverse(obj, VisitReferent, this);
+    }
+  }
+
+  return true;
+}
+
+
+std::vector<HeapCensus::TypeStats> HeapCensus::GetTopTypes(int n) const {
+  std::vector<std::pair<PyObject*, Counters>> types(
+      counters_.begin(),
+      counters_.end());
+
+  const size_t top_count = std::min(types.size(), static_cast<size_t>(n));
+  std::partial_sort(
+      types.begin(),
+      types.begin() + top_count,
+      types.end(),
+      [] (const std::pair<PyObject*, Counters>& t1,
+          const std::pair<PyObject*, Counters>& t2) {
+        return t1.second.size > t2.second.size;
+      });
+
+  std::vector<TypeStats> top_types;
+  for (size_t i = 0; i < top_count; ++i) {
+    top_types.push_back({
+        GetTypeName(types[i].first),
+        types[i].second.count,
+        types[i].second.size
+    });
+  }
+
+  return top_types;
+}
+
+
+bool HeapCensus::CountObject(PyObject* obj) {
+  if (IsOverBudget()) {
+    truncated_ = true;
+    return false;
+  }
+
+  PyObject* type_key = PyInstance_Check(obj)
+      ? reinterpret_cast<PyObject*>(
+            reinterpret_cast<PyInstanceObject*>(obj)->in_class)
+      : reinterpret_cast<PyObject*>(Py_TYPE(obj));
+
+  const int64 size = ApproximateSize(obj);
+
+  Counters& counters = counters_[type_key];
+  ++counters.count;
+  counters.size += size;
+
+  ++object_count_;
+  total_size_ += size;
+
+  return true;
+}
+
+
+int HeapCensus::VisitReferent(PyObject* obj, void* census) {
+  HeapCensus* instance = reinterpret_cast<HeapCensus*>(census);
+
+  if (obj == nullptr) {
+    return 0;
+  }
+
+  // Tracked objects are enumerated by the garbage collector.
+  if (PyObject_IS_GC(obj) && _PyObject_GC_IS_TRACKED(obj)) {
+    return 0;
+  }
+
+  if (!instance->untracked_objects_.insert(obj).second) {
+    return 0;  // Already counted.
+  }
+
+  // Non zero return value stops the traversal.
+  return instance->CountObject(obj) ? 0 : 1;
+}
+
+
+bool HeapCensus::IsOverBudget() {
+  if (object_count_ >= max_objects_) {
+    return true;
+  }
+
+  return ((object_count_ % kTimeCheckInterval) == 0) &&
+         (GetMonotonicTimeNs() - start_time_ns_ >= max_time_ns_);
+}
+
+}  // namespace cdbg
+}  // namespace devtools
@@ -0,0 +1,118 @@
+/**
+ * Copyright 2015 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DEVTOOLS_CDBG_DEBUGLETS_PYTHON_HEAP_CENSUS_H_
+#define DEVTOOLS_CDBG_DEBUGLETS_PYTHON_HEAP_CENSUS_H_
+
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "common.h"
+#include "python_util.h"
+
+namespace devtools {
+namespace cdbg {
+
+// Counts live Python objects and their approximate sizes per type.
+//
+// The census enumerates all the objects tracked by the garbage collector
+// (containers and instances). Objects that the garbage collector doesn't
+// track (strings, numbers and untracked containers) are found as direct
+// referents of the tracked objects. Each object is counted once.
+//
+// Sizes are shallow: the object header and the storage the object owns
+// directly (like the item array of a list or the hash table of a dict), but
+// not the objects it references. Instances of old style classes are
+// grouped by their class rather than as "instance".
+//
+// The census runs with Interpreter Lock held, so it is bounded by the number
+// of visited objects and by wall clock time. If either limit is reached the
+// result is partial.
+//
+// The tracked objects are enumerated with "gc.get_objects", which builds a
+// list of all of them before any limit applies. The list transiently takes
+// a pointer per tracked object (8 MB per million objects on 64 bit
+// platforms) and building it is part of the pause, however small
+// "max_objects" is.
+class HeapCensus {
+ public:
+  // Statistics of a single type.
+  struct TypeStats {
+    string name;
+    int64 count;
+    int64 size;
+  };
+
+  HeapCensus(int64 max_objects, int64 max_time_ns);
+
+  // Runs the census. Returns false and sets Python exception on failure.
+  // Must be called with Interpreter Lock held.
+  bool Run();
+
+  // Gets statistics of the "n" types with the largest total size. Must be
+  // called with Interpreter Lock held.
+  std::vector<TypeStats> GetTopTypes(int n) const;
+
+  // Number of objects counted.
+  int64 object_count() const { return object_count_; }
+
+  // Approximate total size of the counted objects.
+  int64 total_size() const { return total_size_; }
+
+  // True if the census stopped early due to one of the limits.
+  bool truncated() const { return truncated_; }
+
+ private:
+  // Counts a single object. Returns false once the limits are reached.
+  bool CountObject(PyObject* obj);
+
+  // "visitproc" callback of "tp_traverse" counting untracked referents.
+  static int VisitReferent(PyObject* obj, void* census);
+
+  // Returns true if either limit has been reached.
+  bool IsOverBudget();
+
+ private:
+  // Limits.
+  const int64 max_objects_;
+  const int64 max_time_ns_;
+
+  // Time when "Run" was called.
+  int64 start_time_ns_;
+
+  // Statistics keyed by type object (or by class for old style instances).
+  // Types can't go away while Interpreter Lock is held.
+  struct Counters {
+    int64 count;
+    int64 size;
+  };
+  std::unordered_map<PyObject*, Counters> counters_;
+
+  // Untracked objects that have already been counted.
+  std::unordered_set<PyObject*> untracked_objects_;
+
+  // Totals.
+  int64 object_count_;
+  int64 total_size_;
+  bool truncated_;
+
+  DISALLOW_COPY_AND_ASSIGN(HeapCensus);
+};
+
+}  // namespace cdbg
+}  // namespace devtools
+
+#endif  // DEVTOOLS_CDBG_DEBUGLETS_PYTHON_HEAP_CENSUS_H_
@@ -0,0 +1,560 @@
+# Copyright 2015 Google Inc. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS-IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Shares a single hub connection between all debugged processes on a host.
+
+Prefork servers (gunicorn, uwsgi) run many worker processes of the same
+application. Without coordination each of them registers the debuggee,
+keeps its own long poll of active breakpoints and its own transmission
+thread.
+
+In the coordinator mode, processes pointing to the same Unix domain socket
+elect a single coordinator. The coordinator is the process holding an
+exclusive lock on "<socket>.lock". Only the coordinator talks to the hub. It
+broadcasts the list of active breakpoints to all the subscribed processes
+and forwards breakpoint updates they submit. If the coordinator exits, the
+lock is released by the kernel, subscribers lose their connection and elect
+a new coordinator.
+
+The protocol is newline delimited JSON messages:
+  coordinator -> subscriber: {"breakpoints": [...]}
+  subscriber -> coordinator: {"update": {...}}
+"""
+
+import errno
+import fcntl
+import json
+import os
+import select
+import socket
+import threading
+import time
+import traceback
+
+import cdbg_native as native
+import googleclouddebugger
+
+# This module catches all exception. This is safe because it runs in
+# a daemon thread (so we are not blocking Ctrl+C).
+# pylint: disable=broad-except
+
+# Maximum number of breakpoint updates kept while there is no coordinator.
+_MAX_PENDING_UPDATES = 100
+
+
+class HubCoordinatorClient(object):
+  """Hub client that shares the hub connection with other local processes.
+
+  This class exposes the same interface to BreakpointsManager as
+  GcpHubClient does.
+  """
+
+  def __init__(self, socket_path, hub_client_factory):
+    """Class constructor.
+
+    Args:
+      socket_path: path of the Unix domain socket shared by all processes.
+      hub_client_factory: callable that creates a configured GcpHubClient.
+          Only called in the process that becomes the coordinator.
+    """
+    self.on_active_breakpoints_changed = lambda x: None
+    self.on_idle = lambda: None
+    self._socket_path = socket_path
+    self._lock_path = socket_path + '.lock'
+    self._hub_client_factory = hub_client_factory
+    self._lock = threading.RLock()
+
+    # Serializes messages sent to subscribers. Sending can block for up to
+    # send_timeout_sec, so it happens outside of self._lock, which
+    # application threads need. Acquired after self._lock (if both).
+    self._send_lock = threading.Lock()
+    self._shutdown = False
+    self._thread = None
+    self._pid = os.getpid()
+
+    # Coordinator state.
+    self._lock_fd = None
+    self._listener = None
+    self._hub_client = None
+    self._subscribers = []
+    self._breakpoints = None
+
+    # Subscriber state.
+    self._connection = None
+    self._pending_updates = []
+
+    # Pipe used to wake up the subscriber thread to send pending updates.
+    self._wakeup_fds = None
+
+    #
+    # Configuration options (constants only modified by unit test)
+    #
+
+    # Delay before retrying the election if neither bind nor connect worked.
+    self.election_retry_sec = 1
+
+    # Interval of on_idle notifications in the subscriber mode.
+    self.idle_interval_sec = 10
+
+    # Timeout for sending a message to a subscriber.
+    self.send_timeout_sec = 5
+
+  def Start(self):
+    """Starts the worker thread."""
+    self._shutdown = False
+
+    self._thread = threading.Thread(target=self._MainThreadProc)
+    self._thread.name = 'Cloud Debugger hub coordinator'
+    self._thread.daemon = True
+    self._thread.start()
+
+  def Stop(self):
+    """Signals the worker thread to shut down and waits until it exits."""
+    self._shutdown = True
+    if self._thread is not None:
+      self._thread.join()
+      self._thread = None
+
+    with self._lock:
+      if self._hub_client is not None:
+        self._hub_client.Stop()
+
+  def AfterFork(self):
+    """Restarts the worker thread in a forked child process.
+
+    The child process closes its copies of the inherited sockets and of the
+    lock file descriptor. Otherwise the coordinator lock would be held even
+    after the parent process exits. The child then goes through the
+    election, typically subscribing to the parent process.
+    """
+    if self._pid == os.getpid():
+      return  # Not a forked process or already reinitialized.
+
+    self._pid = os.getpid()
+
+    if self._lock_fd is not None:
+      os.close(self._lock_fd)
+      self._lock_fd = None
+
+    for s in [self._listener, self._connection] + self._subscribers:
+      if s is not None:
+        s.close()
+
+    if self._wakeup_fds is not None:
+      for fd in self._wakeup_fds:
+        os.close(fd)
+
+    self._lock = threading.RLock()
+    self._send_lock = threading.Lock()
+    self._thread = None
+    self._hub_client = None
+    self._listener = None
+    self._subscribers = []
+    self._breakpoints = None
+    self._connection = None
+    self._pending_updates = []
+    self._wakeup_fds = None
+
+    self.Start()
+
+  def IsCoordinator(self):
+    """Returns True if this process holds the hub connection."""
+    return self._hub_client is not None
+
+  def EnqueueBreakpointUpdate(self, breakpoint):
+    """Sends the breakpoint update to the hub through the coordinator.
+
+    In the subscriber mode the update is only queued here. The subscriber
+    thread sends it, so that application threads never block on the socket.
+
+    Args:
+      breakpoint: breakpoint in either final or non-final state.
+    """
+    if self._pid != os.getpid():
+      # The process was forked without going through os.fork.
+      googleclouddebugger.AfterFork()
+
+    with self._lock:
+      if self._hub_client is not None:
+        self._hub_client.EnqueueBreakpointUpdate(breakpoint)
+        return
+
+      if len(self._pending_updates) >= _MAX_PENDING_UPDATES:
+        native.LogWarning(
+            'No hub coordinator, dropping breakpoint %s update' %
+            breakpoint['id'])
+        return
+
+      # Captured variables table is already serialized (see
+      # CaptureCollector), which only native.EncodeJson understands.
+      self._pending_updates.append(
+          native.EncodeJson({'update': breakpoint}) + '\n')
+      self._WakeUpSubscriber()
+
+  def GetMemoryUsage(self):
+    """Returns the number of bytes used by pending breakpoint updates."""
+    with self._lock:
+      if self._hub_client is not None:
+        return self._hub_client.GetMemoryUsage()
+
+      return sum(len(update) for update in self._pending_updates)
+
+  def ReleaseMemory(self):
+    """Releases memory of pending non-final breakpoint updates.
+
+    Updates queued for the coordinator are already serialized, so only the
+    coordinator process can tell which of them are non-final.
+    """
+    with self._lock:
+      if self._hub_client is not None:
+        self._hub_client.ReleaseMemory()
+
+  def _MainThreadProc(self):
+    """Elects the coordinator and runs the corresponding role."""
+    while not self._shutdown:
+      self._lock_fd = self._TryAcquireCoordinatorLock()
+      if self._lock_fd is not None:
+        try:
+          self._RunCoordinator()
+          return  # Shutdown. The lock is held until the process exits.
+        except Exception:
+          native.LogError('Hub coordinator failed: %s' %
+                          traceback.format_exc())
+
+        # Give up the coordinator role, so that the election can start over.
+        self._StopCoordinator()
+        time.sleep(self.election_retry_sec)
+        continue
+
+      connection = self._TryConnect()
+      if connection is None:
+        time.sleep(self.election_retry_sec)
+        continue
+
+      native.LogInfo('Subscribed to hub coordinator %s' % self._socket_path)
+      try:
+        self._RunSubscriber(connection)
+      except Exception:
+        native.LogWarning('Hub coordinator connection failed: %s' %
+                          traceback.format_exc())
+      finally:
+        with self._lock:
+          self._connection = None
+        connection.close()
+
+  def _TryAcquireCoordinatorLock(self):
+    """Tries to become the coordinator.
+
+    Returns:
+      File descriptor holding the lock or None if another process is the
+      coordinator.
+    """
+    try:
+      fd = os.open(self._lock_path, os.O_RDWR | os.O_CREAT, 0600)
+    except OSError as e:
+      native.LogWarning('Failed to open %s: %s' % (self._lock_path, e))
+      return None
+
+    try:
+      fcntl.flock(fd, fcntl.LOCK_EX | fcntl.LOCK_NB)
+    except IOError:
+      os.close(fd)
+      return None
+
+    return fd
+
+  def _TryConnect(self):
+    """Connects to the coordinator socket or returns None on failure."""
+    connection = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    try:
+      connection.connect(self._socket_path)
+    except socket.error:
+      connection.close()
+      return None
+
+    connection.settimeout(self.send_timeout_sec)
+    with self._lock:
+      self._connection = connection
+
+    return connection
+
+  def _RunCoordinator(self):
+    """Runs the hub client and serves subscribers until shutdown."""
+    # Socket file left behind by the previous coordinator.
+    try:
+      os.unlink(self._socket_path)
+    except OSError as e:
+      if e.errno != errno.ENOENT:
+        raise
+
+    listener = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    listener.bind(self._socket_path)
+    os.chmod(self._socket_path, 0600)
+    listener.listen(128)
+    self._listener = listener
+
+    hub_client = self._hub_client_factory()
+    hub_client.on_active_breakpoints_changed = self._BroadcastBreakpoints
+    hub_client.on_idle = lambda: self.on_idle()
+
+    with self._lock:
+      self._hub_client = hub_client
+      pending_updates = self._pending_updates
+      self._pending_updates = []
+
+    for message in pending_updates:
+      hub_client.EnqueueBreakpointUpdate(json.loads(message)['update'])
+
+    native.LogInfo('Hub coordinator listening on %s' % self._socket_path)
+    hub_client.Start()
+
+    buffers = {}
+    while not self._shutdown:
+      with self._lock:
+        subscribers = list(self._subscribers)
+
+      readable, unused_writable, unused_error = select.select(
+          [listener] + subscribers, [], [], 1)
+
+      for s in readable:
+        if s is listener:
+          self._AcceptSubscriber(listener)
+          continue
+
+        try:
+          data = s.recv(65536)
+        except socket.error:
+          data = ''
+
+        if not data:
+          self._RemoveSubscriber(s)
+          buffers.pop(s, None)
+          continue
+
+        # A misbehaving subscriber must not take down the coordinator.
+        for message in _SplitMessages(buffers, s, data):
+          update = message.get('update')
+          if not isinstance(update, dict):
+            native.LogWarning('Malformed hub coordinator message')
+            continue
+
+          try:
+            hub_client.EnqueueBreakpointUpdate(update)
+          except Exception:
+            native.LogWarning('Failed to enqueue breakpoint update: %s' %
+                              traceback.format_exc())
+
+    listener.close()
+
+  def _StopCoordinator(self):
+    """Releases the coordinator resources after _RunCoordinator failed.
+
+    Subscribers are disconnected and the lock is released last, after the
+    hub client stopped, so that only one process talks to the hub at a time.
+    Breakpoint updates enqueued from now on are kept in the pending queue.
+    """
+    with self._lock:
+      listener = self._listener
+      subscribers = self._subscribers
+      hub_client = self._hub_client
+      self._listener = None
+      self._subscribers = []
+      self._hub_client = None
+      self._breakpoints = None
+
+    if listener is not None:
+      listener.close()
+
+    for subscriber in subscribers:
+      subscriber.close()
+
+    if hub_client is not None:
+      try:
+        hub_client.Stop()
+      except Exception:
+        native.LogWarning('Failed to stop hub client: %s' %
+                          traceback.format_exc())
+
+    os.close(self._lock_fd)
+    self._lock_fd = None
+
+  def _AcceptSubscriber(self, listener):
+    """Accepts a new subscriber and sends it the current breakpoints."""
+    try:
+      subscriber, unused_address = listener.accept()
+    except socket.error:
+      return
+
+    subscriber.settimeout(self.send_timeout_sec)
+    with self._lock:
+      self._subscribers.append(subscriber)
+      if self._breakpoints is None:
+        return
+
+      message = json.dumps({'breakpoints': self._breakpoints}) + '\n'
+
+      # Taking the send lock before releasing self._lock keeps the order of
+      # breakpoint lists sent to the subscriber.
+      self._send_lock.acquire()
+
+    self._SendToSubscribers([subscriber], message)
+
+  def _RemoveSubscriber(self, subscriber):
+    with self._lock:
+      if subscriber in self._subscribers:
+        self._subscribers.remove(subscriber)
+    subscriber.close()
+
+  def _SendToSubscribers(self, subscribers, message):
+    """Sends message to subscribers. Drops the subscribers that failed.
+
+    Must be called with self._send_lock held (and not self._lock). Releases
+    self._send_lock.
+    """
+    failed_subscribers = []
+    try:
+      for subscriber in subscribers:
+        try:
+          subscriber.sendall(message)
+        except socket.error as e:
+          native.LogWarning('Dropping hub coordinator subscriber: %s' % e)
+          failed_subscribers.append(subscriber)
+    finally:
+      self._send_lock.release()
+
+    for subscriber in failed_subscribers:
+      self._RemoveSubscriber(subscriber)
+
+  def _BroadcastBreakpoints(self, breakpoints):
+    """Callback invoked by the hub client when active breakpoints change."""
+    message = json.dumps({'breakpoints': breakpoints}) + '\n'
+    with self._lock:
+      self._breakpoints = breakpoints
+      subscribers = list(self._subscribers)
+      self._send_lock.acquire()
+
+    self._SendToSubscribers(subscribers, message)
+
+    self.on_active_breakpoints_changed(breakpoints)
+
+  def _RunSubscriber(self, connection):
+    """Receives breakpoint lists until the coordinator goes away.
+
+    Also sends the pending breakpoint updates to the coordinator.
+    """
+    wakeup_read_fd, wakeup_write_fd = os.pipe()
+    flags = fcntl.fcntl(wakeup_write_fd, fcntl.F_GETFL)
+    fcntl.fcntl(wakeup_write_fd, fcntl.F_SETFL, flags | os.O_NONBLOCK)
+    with self._lock:
+      self._wakeup_fds = (wakeup_read_fd, wakeup_write_fd)
+
+    try:
+      self._RunSubscriberLoop(connection, wakeup_read_fd)
+    finally:
+      with self._lock:
+        self._wakeup_fds = None
+      os.close(wakeup_read_fd)
+      os.close(wakeup_write_fd)
+
+  def _RunSubscriberLoop(self, connection, wakeup_read_fd):
+    """Subscriber loop of _RunSubscriber."""
+    buffers = {}
+    last_idle_time = time.time()
+    while not self._shutdown:
+      self._SendPendingUpdates(connection)
+
+      readable, unused_writable, unused_error = select.select(
+          [connection, wakeup_read_fd], [], [], 1)
+
+      if wakeup_read_fd in readable:
+        os.read(wakeup_read_fd, 4096)
+
+      if connection in readable:
+        data = connection.recv(65536)
+        if not data:
+          native.LogInfo('Hub coordinator disconnected')
+          return
+
+        for message in _SplitMessages(buffers, connection, data):
+          breakpoints = message.get('breakpoints')
+          if isinstance(breakpoints, list):
+            self.on_active_breakpoints_changed(breakpoints)
+
+      if time.time() - last_idle_time >= self.idle_interval_sec:
+        last_idle_time = time.time()
+        self.on_idle()
+
+  def _WakeUpSubscriber(self):
+    """Wakes up the subscriber thread to send pending updates.
+
+    Must be called with the lock held.
+    """
+    if self._wakeup_fds is None:
+      return  # Not connected. Updates are sent once the thread subscribes.
+
+    try:
+      os.write(self._wakeup_fds[1], 'x')
+    except OSError as e:
+      if e.errno != errno.EAGAIN:  # The thread is already woken up.
+        raise
+
+  def _SendPendingUpdates(self, connection):
+    """Sends updates queued by application threads to the coordinator.
+
+    Runs on the subscriber thread and sends outside of the lock. Only this
+    thread removes updates from the queue. If sending fails, the update
+    stays in the queue and the exception drops the connection. The message
+    might have been sent partially, so it can't be retried on the same
+    connection.
+    """
+    while True:
+      with self._lock:
+        if not self._pending_updates:
+          return
+        message = self._pending_updates[0]
+
+      connection.sendall(message)
+
+      with self._lock:
+        del self._pending_updates[0]
+
+
+def _SplitMessages(buffers, key, data):
+  """Splits received data into complete messages.
+
+  Args:
+    buffers: dictionary of incomplete messages keyed by connection.
+    key: connection the data was received from.
+    data: received chunk.
+
+  Returns:
+    List of decoded messages (dictionaries).
+  """
+  lines = (buffers.pop(key, '') + data).split('\n')
+  if lines[-1]:
+    buffers[key] = lines[-1]
+
+  messages = []
+  for line in lines[:-1]:
+    try:
+      message = json.loads(line)
+    except ValueError:
+      message = None
+
+    if isinstance(message, dict):
+      messages.append(message)
+    else:
+      native.LogWarning('Malformed hub coordinator message')
+
+  return messages
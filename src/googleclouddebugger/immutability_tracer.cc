@@ -21,11 +21,46 @@
 
 #include "python_util.h"
 
+#include <time.h>
+
 DEFINE_int32(
     max_expression_lines,
     10000,
     "maximum number of Python lines to allow in a single expression");
 
+DEFINE_int32(
+    max_condition_wall_time_us,
+    10000,
+    "maximum wall clock time to spend evaluating breakpoint condition");
+
+DEFINE_int32(
+    max_condition_cpu_time_us,
+    5000,
+    "maximum CPU time to spend evaluating breakpoint condition");
+
+DEFINE_int32(
+    max_watch_expression_wall_time_us,
+    100000,
+    "maximum wall clock time to spend evaluating a single watched "
+    "expression");
+
+DEFINE_int32(
+    max_watch_expression_cpu_time_us,
+    50000,
+    "maximum CPU time to spend evaluating a single watched expression");
+
+DEFINE_int32(
+    max_log_expression_wall_time_us,
+    20000,
+    "maximum wall clock time to spend evaluating a single expression in a "
+    "logpoint message");
+
+DEFINE_int32(
+    max_log_expression_cpu_time_us,
+    10000,
+    "maximum CPU time to spend evaluating a single expression in a logpoint "
+    "message");
+
 namespace devtools {
 namespace cdbg {
 
@@ -98,6 +133,20 @@ static const char* kWhitelistedCFunctions[] = {
 };
 
 
+// Number of trace callbacks between checks of the time limits. A single
+// Python line is cheap, so checking every few lines is accurate enough, while
+// reading the clock on every callback adds measurable cost to short
+// expressions.
+static const int32 kDeadlineCheckInterval = 8;
+
+
+static int64 GetClockNs(clockid_t clock_id) {
+  timespec time;
+  clock_gettime(clock_id, &time);
+  return time.tv_sec * 1000000000LL + time.tv_nsec;
+}
+
+
 static const char* kBlacklistedCodeObjectNames[] = {
   "__setattr__",
   "__delattr__",
@@ -117,7 +166,13 @@ ImmutabilityTracer::ImmutabilityTracer()
       thread_state_(nullptr),
       original_thread_state_tracing_(0),
       line_count_(0),
-      mutable_code_detected_(false) {
+      mutable_code_detected_(false),
+      start_wall_time_ns_(0),
+      start_cpu_time_ns_(0),
+      max_wall_time_ns_(0),
+      max_cpu_time_ns_(0),
+      callbacks_since_deadline_check_(0),
+      deadline_exceeded_(false) {
 }
 
 
@@ -126,10 +181,30 @@ ImmutabilityTracer::~ImmutabilityTracer() {
 }
 
 
-void ImmutabilityTracer::Start(PyObject* self) {
+void ImmutabilityTracer::Start(PyObject* self, ExpressionKind kind) {
   self_ = self;
   DCHECK(self_);
 
+  switch (kind) {
+    case ExpressionKind::Condition:
+      max_wall_time_ns_ = FLAGS_max_condition_wall_time_us * 1000LL;
+      max_cpu_time_ns_ = FLAGS_max_condition_cpu_time_us * 1000LL;
+      break;
+
+    case ExpressionKind::WatchExpression:
+      max_wall_time_ns_ = FLAGS_max_watch_expression_wall_time_us * 1000LL;
+      max_cpu_time_ns_ = FLAGS_max_watch_expression_cpu_time_us * 1000LL;
+      break;
+
+    case ExpressionKind::LogExpression:
+      max_wall_time_ns_ = FLAGS_max_log_expression_wall_time_us * 1000LL;
+      max_cpu_time_ns_ = FLAGS_max_log_expression_cpu_time_us * 1000LL;
+      break;
+  }
+
+  start_wall_time_ns_ = GetClockNs(CLOCK_MONOTONIC);
+  start_cpu_time_ns_ = GetClockNs(CLOCK_THREAD_CPUTIME_ID);
+
   thread_state_ = PyThreadState_GET();
   DCHECK(thread_state_);
 
@@ -202,10 +277,53 @@ int ImmutabilityTracer::OnTraceCallbackInternal(
     return -1;
   }
 
+  // Native calls can run for a long time as a single trace event, so the
+  // time limits are always checked after one returns.
+  if ((what == PyTrace_C_RETURN) ||
+      (what == PyTrace_C_EXCEPTION) ||
+      (++callbacks_since_deadline_check_ >= kDeadlineCheckInterval)) {
+    CheckDeadline();
+  }
+
+  if (deadline_exceeded_) {
+    SetDeadlineExceededException();
+    return -1;
+  }
+
   return 0;
 }
 
 
+void ImmutabilityTracer::CheckDeadline() {
+  callbacks_since_deadline_check_ = 0;
+
+  if (deadline_exceeded_) {
+    return;
+  }
+
+  const int64 wall_time_ns =
+      GetClockNs(CLOCK_MONOTONIC) - start_wall_time_ns_;
+  if (wall_time_ns > max_wall_time_ns_) {
+    LOG(INFO) << "Expression evaluation exceeded wall time limit";
+    deadline_exceeded_ = true;
+    return;
+  }
+
+  // The thread can't consume more CPU time than the elapsed wall clock time,
+  // so there is no need to read the (more expensive) CPU clock until then.
+  if (wall_time_ns <= max_cpu_time_ns_) {
+    return;
+  }
+
+  const int64 cpu_time_ns =
+      GetClockNs(CLOCK_THREAD_CPUTIME_ID) - start_cpu_time_ns_;
+  if (cpu_time_ns > max_cpu_time_ns_) {
+    LOG(INFO) << "Expression evaluation exceeded CPU time limit";
+    deadline_exceeded_ = true;
+  }
+}
+
+
 void ImmutabilityTracer::VerifyCodeObject(ScopedPyCodeObject code_object) {
   if (code_object == nullptr) {
     return;
@@ -503,6 +621,13 @@ void ImmutabilityTracer::SetMutableCodeException() {
       "Only immutable methods can be called from expressions");
 }
 
+
+void ImmutabilityTracer::SetDeadlineExceededException() {
+  PyErr_SetString(
+      PyExc_SystemError,
+      "Expression evaluation exceeded the time limit");
+}
+
 }  // namespace cdbg
 }  // namespace devtools
 
@@ -24,6 +24,20 @@
 namespace devtools {
 namespace cdbg {
 
+// Kind of expression evaluated with immutability tracer. Each kind has its
+// own time limits (see "max_*_wall_time_us" and "max_*_cpu_time_us" flags).
+enum class ExpressionKind {
+  // Breakpoint condition. Evaluated on every breakpoint hit.
+  Condition,
+
+  // Watched expression of a snapshot. Evaluated once.
+  WatchExpression,
+
+  // Expression embedded in the message of a logpoint. Evaluated on every
+  // logpoint hit.
+  LogExpression
+};
+
 // Uses Python line tracer to track evaluation of Python expression. As the
 // evaluation progresses, verifies that no opcodes with side effect are
 // executed.
@@ -31,6 +45,12 @@ namespace cdbg {
 // Execution of code with side effects will be blocked and exception will
 // be thrown.
 //
+// The evaluation is also bounded by the number of executed lines and by
+// wall clock and CPU time. The time limits are checked every few trace
+// callbacks and on every return from a native function. A single native
+// call (like "sorted" on a huge list) can't be interrupted, but the
+// evaluation is stopped as soon as it returns.
+//
 // This class is not thread safe. All the functions assume Interpreter Lock
 // held by the current thread.
 //
@@ -44,7 +64,7 @@ class ImmutabilityTracer {
   ~ImmutabilityTracer();
 
   // Starts immutability tracer on the current thread.
-  void Start(PyObject* self);
+  void Start(PyObject* self, ExpressionKind kind);
 
   // Stops immutability tracer on the current thread.
   void Stop();
@@ -53,6 +73,10 @@ class ImmutabilityTracer {
   // a mutable code.
   bool IsMutableCodeDetected() const { return mutable_code_detected_; }
 
+  // Returns true if the expression wasn't completely executed because it
+  // took too long.
+  bool IsDeadlineExceeded() const { return deadline_exceeded_; }
+
   // Gets the number of lines executed while the tracer was enabled. Native
   // functions calls are counted as a single line.
   int32 GetLineCount() const { return line_count_; }
@@ -83,9 +107,15 @@ class ImmutabilityTracer {
   // Verifies that the called C function is whitelisted.
   void ProcessCCall(PyObject* function);
 
+  // Checks the time limits of the evaluation.
+  void CheckDeadline();
+
   // Sets an exception indicating that the code is mutable.
   void SetMutableCodeException();
 
+  // Sets an exception indicating that the evaluation took too long.
+  void SetDeadlineExceededException();
+
  public:
   // Definition of Python type object.
   static PyTypeObject python_type_;
@@ -115,6 +145,21 @@ class ImmutabilityTracer {
   // want to stop execution of the entire construct entirely.
   bool mutable_code_detected_;
 
+  // Wall clock and thread CPU time when the evaluation started.
+  int64 start_wall_time_ns_;
+  int64 start_cpu_time_ns_;
+
+  // Time limits of the evaluation.
+  int64 max_wall_time_ns_;
+  int64 max_cpu_time_ns_;
+
+  // Number of trace callbacks since the time limits were last checked.
+  int32 callbacks_since_deadline_check_;
+
+  // Set to true when one of the deadlines passes. Stops the execution the
+  // same way as "mutable_code_detected_".
+  bool deadline_exceeded_;
+
   DISALLOW_COPY_AND_ASSIGN(ImmutabilityTracer);
 };
 
@@ -125,9 +170,9 @@ class ImmutabilityTracer {
 // its lifetime.
 class ScopedImmutabilityTracer {
  public:
-  ScopedImmutabilityTracer()
+  explicit ScopedImmutabilityTracer(ExpressionKind kind)
       : tracer_(NewNativePythonObject<ImmutabilityTracer>()) {
-    Instance()->Start(tracer_.get());
+    Instance()->Start(tracer_.get(), kind);
   }
 
   ~ScopedImmutabilityTracer() {
@@ -140,6 +185,12 @@ class ScopedImmutabilityTracer {
     return Instance()->IsMutableCodeDetected();
   }
 
+  // Returns true if the expression wasn't completely executed because it
+  // took too long.
+  bool IsDeadlineExceeded() const {
+    return Instance()->IsDeadlineExceeded();
+  }
+
   // Gets the number of lines executed while the tracer was enabled. Native
   // functions calls are counted as a single line.
   int32 GetLineCount() const { return Instance()->GetLineCount(); }
@@ -0,0 +1,375 @@
+/**
+ * Copyright 2015 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Ensure that Python.h is included before any other header.
+#include "common.h"
+
+#include "json_encoder.h"
+
+namespace devtools {
+namespace cdbg {
+
+// Maximum nesting level of dictionaries and lists. Deeper structures are
+// assumed to have a reference cycle.
+static const int kMaxDepth = 100;
+
+static const char kHexDigits[] = "0123456789abcdef";
+
+PyTypeObject JsonFragment::python_type_ =
+    DefaultTypeDefinition(CDBG_SCOPED_NAME("_JsonFragment"));
+
+
+// Appends "\uXXXX" escape sequence.
+static void AppendUnicodeEscape(uint32 code_unit, string* output) {
+  const char escape[] = {
+    '\\',
+    'u',
+    kHexDigits[(code_unit >> 12) & 0xF],
+    kHexDigits[(code_unit >> 8) & 0xF],
+    kHexDigits[(code_unit >> 4) & 0xF],
+    kHexDigits[code_unit & 0xF]
+  };
+
+  output->append(escape, sizeof(escape));
+}
+
+
+// Appends a single code point escaping it as necessary.
+static void AppendCodePoint(uint32 code_point, string* output) {
+  switch (code_point) {
+    case '"':
+      output->append("\\\"", 2);
+      return;
+
+    case '\\':
+      output->append("\\\\", 2);
+      return;
+
+    case '\n':
+      output->append("\\n", 2);
+      return;
+
+    case '\r':
+      output->append("\\r", 2);
+      return;
+
+    case '\t':
+      output->append("\\t", 2);
+      return;
+
+    case '\b':
+      output->append("\\b", 2);
+      return;
+
+    case '\f':
+      output->append("\\f", 2);
+      return;
+  }
+
+  if ((code_point >= 0x20) && (code_point < 0x7F)) {
+    output->push_back(static_cast<char>(code_point));
+  } else if (code_point < 0x10000) {
+    AppendUnicodeEscape(code_point, output);
+  } else {
+    code_point -= 0x10000;
+    AppendUnicodeEscape(0xD800 | (code_point >> 10), output);
+    AppendUnicodeEscape(0xDC00 | (code_point & 0x3FF), output);
+  }
+}
+
+
+// Decodes a multi-byte UTF-8 sequence starting at "data". Returns the number
+// of bytes in the sequence or 0 if it is not a valid UTF-8 sequence.
+static int DecodeUtf8Sequence(
+    const uint8* data,
+    const uint8* end,
+    uint32* code_point) {
+  int continuation_bytes;
+  uint32 min_code_point;
+  if ((*data & 0xE0) == 0xC0) {
+    continuation_bytes = 1;
+    min_code_point = 0x80;
+    *code_point = *data & 0x1F;
+  } else if ((*data & 0xF0) == 0xE0) {
+    continuation_bytes = 2;
+    min_code_point = 0x800;
+    *code_point = *data & 0x0F;
+  } else if ((*data & 0xF8) == 0xF0) {
+    continuation_bytes = 3;
+    min_code_point = 0x10000;
+    *code_point = *data & 0x07;
+  } else {
+    return 0;
+  }
+
+  if (end - data <= continuation_bytes) {
+    return 0;
+  }
+
+  for (int i = 1; i <= continuation_bytes; ++i) {
+    if ((data[i] & 0xC0) != 0x80) {
+      return 0;
+    }
+
+    *code_point = (*code_point << 6) | (data[i] & 0x3F);
+  }
+
+  if ((*code_point < min_code_point) || (*code_point > 0x10FFFF)) {
+    return 0;
+  }
+
+  return continuation_bytes + 1;
+}
+
+
+// Appends quoted and escaped UTF-8 string. Each byte that doesn't start a
+// valid UTF-8 sequence is replaced with U+FFFD (like decoding the string with
+// "replace" error handler), so that binary data in "str" objects doesn't
+// fail the whole message.
+static void AppendUtf8String(const uint8* data, size_t size, string* output) {
+  output->push_back('"');
+
+  const uint8* const end = data + size;
+  while (data < end) {
+    uint32 code_point = *data;
+    if (code_point < 0x80) {
+      data += 1;
+    } else {
+      const int sequence_size = DecodeUtf8Sequence(data, end, &code_point);
+      if (sequence_size == 0) {
+        code_point = 0xFFFD;
+        data += 1;
+      } else {
+        data += sequence_size;
+      }
+    }
+
+    AppendCodePoint(code_point, output);
+  }
+
+  output->push_back('"');
+}
+
+
+// Appends quoted and escaped unicode string. Narrow Python builds store
+// characters outside of BMP as surrogate pairs, which are escaped one code
+// unit at a time. This yields the same result as wide builds.
+static void AppendUnicodeString(
+    const Py_UNICODE* data,
+    size_t size,
+    string* output) {
+  output->push_back('"');
+
+  for (const Py_UNICODE* end = data + size; data < end; ++data) {
+    AppendCodePoint(static_cast<uint32>(*data), output);
+  }
+
+  output->push_back('"');
+}
+
+
+ScopedPyObject JsonFragment::Create(PyObject* json) {
+  ScopedPyObject fragment = NewNativePythonObject<JsonFragment>();
+  if (fragment == nullptr) {
+    return ScopedPyObject();
+  }
+
+  py_object_cast<JsonFragment>(fragment.get())->json_ =
+      ScopedPyObject::NewReference(json);
+
+  return fragment;
+}
+
+
+bool JsonEncoder::Prepare(PyObject* obj) {
+  skeleton_.clear();
+  strings_.clear();
+  strings_size_ = 0;
+
+  return PrepareValue(obj, 0);
+}
+
+
+bool JsonEncoder::PrepareValue(PyObject* obj, int depth) {
+  if (depth > kMaxDepth) {
+    PyErr_SetString(PyExc_ValueError, "Maximum nesting level exceeded");
+    return false;
+  }
+
+  if (PyString_Check(obj) || PyUnicode_Check(obj)) {
+    PrepareString(obj);
+    return true;
+  }
+
+  if (Py_TYPE(obj) == &JsonFragment::python_type_) {
+    PyObject* json = py_object_cast<JsonFragment>(obj)->json_.get();
+    skeleton_.append(PyString_AS_STRING(json), PyString_GET_SIZE(json));
+    return true;
+  }
+
+  if (obj == Py_None) {
+    skeleton_ += "null";
+    return true;
+  }
+
+  if (obj == Py_True) {
+    skeleton_ += "true";
+    return true;
+  }
+
+  if (obj == Py_False) {
+    skeleton_ += "false";
+    return true;
+  }
+
+  if (PyInt_CheckExact(obj)) {
+    skeleton_ += std::to_string(static_cast<int64>(PyInt_AS_LONG(obj)));
+    return true;
+  }
+
+  if (PyLong_CheckExact(obj)) {
+    ScopedPyObject str(PyObject_Str(obj));
+    if (str == nullptr) {
+      return false;
+    }
+
+    skeleton_.append(
+        PyString_AS_STRING(str.get()),
+        PyString_GET_SIZE(str.get()));
+    return true;
+  }
+
+  if (PyFloat_CheckExact(obj)) {
+    const double value = PyFloat_AS_DOUBLE(obj);
+    if (Py_IS_NAN(value)) {
+      skeleton_ += "NaN";
+    } else if (Py_IS_INFINITY(value)) {
+      skeleton_ += (value > 0) ? "Infinity" : "-Infinity";
+    } else {
+      char* str = PyOS_double_to_string(value, 'r', 0, Py_DTSF_ADD_DOT_0,
+                                        nullptr);
+      if (str == nullptr) {
+        return false;
+      }
+
+      skeleton_ += str;
+      PyMem_Free(str);
+    }
+
+    return true;
+  }
+
+  if (PyDict_Check(obj)) {
+    skeleton_ += '{';
+
+    Py_ssize_t pos = 0;
+    PyObject* key = nullptr;
+    PyObject* value = nullptr;
+    bool first = true;
+    while (PyDict_Next(obj, &pos, &key, &value)) {
+      if (!PyString_Check(key) && !PyUnicode_Check(key)) {
+        PyErr_SetString(PyExc_TypeError, "Only string keys are supported");
+        return false;
+      }
+
+      if (!first) {
+        skeleton_ += ',';
+      }
+      first = false;
+
+      PrepareString(key);
+      skeleton_ += ':';
+
+      if (!PrepareValue(value, depth + 1)) {
+        return false;
+      }
+    }
+
+    skeleton_ += '}';
+    return true;
+  }
+
+  if (PyList_Check(obj) || PyTuple_Check(obj)) {
+    ScopedPyObject sequence(PySequence_Fast(obj, "Not a sequence"));
+    if (sequence == nullptr) {
+      return false;
+    }
+
+    skeleton_ += '[';
+
+    const Py_ssize_t size = PySequence_Fast_GET_SIZE(sequence.get());
+    PyObject** items = PySequence_Fast_ITEMS(sequence.get());
+    for (Py_ssize_t i = 0; i < size; ++i) {
+      if (i > 0) {
+        skeleton_ += ',';
+      }
+
+      if (!PrepareValue(items[i], depth + 1)) {
+        return false;
+      }
+    }
+
+    skeleton_ += ']';
+    return true;
+  }
+
+  PyErr_Format(
+      PyExc_TypeError,
+      "Type %s is not JSON serializable",
+      Py_TYPE(obj)->tp_name);
+  return false;
+}
+
+
+void JsonEncoder::PrepareString(PyObject* str) {
+  strings_.push_back({ skeleton_.size(), ScopedPyObject::NewReference(str) });
+  strings_size_ += PyString_Check(str)
+      ? PyString_GET_SIZE(str)
+      : PyUnicode_GET_SIZE(str);
+}
+
+
+void JsonEncoder::Write(string* output) const {
+  output->clear();
+  output->reserve(skeleton_.size() + strings_size_ + strings_.size() * 2);
+
+  size_t skeleton_position = 0;
+  for (const StringReference& reference : strings_) {
+    output->append(
+        skeleton_,
+        skeleton_position,
+        reference.position - skeleton_position);
+    skeleton_position = reference.position;
+
+    PyObject* str = reference.str.get();
+    if (PyString_Check(str)) {
+      AppendUtf8String(
+          reinterpret_cast<const uint8*>(PyString_AS_STRING(str)),
+          PyString_GET_SIZE(str),
+          output);
+    } else {
+      AppendUnicodeString(
+          PyUnicode_AS_UNICODE(str),
+          PyUnicode_GET_SIZE(str),
+          output);
+    }
+  }
+
+  output->append(skeleton_, skeleton_position, string::npos);
+}
+
+}  // namespace cdbg
+}  // namespace devtools
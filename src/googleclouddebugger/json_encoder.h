@@ -0,0 +1,114 @@
+/**
+ * Copyright 2015 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DEVTOOLS_CDBG_DEBUGLETS_PYTHON_JSON_ENCODER_H_
+#define DEVTOOLS_CDBG_DEBUGLETS_PYTHON_JSON_ENCODER_H_
+
+#include <vector>
+#include "common.h"
+#include "python_util.h"
+
+namespace devtools {
+namespace cdbg {
+
+// Serializes breakpoint messages into compact JSON (no whitespace, ASCII only
+// output). The output is identical to:
+//     json.dumps(obj, separators=(',', ':'))
+// except that "str" objects that aren't valid UTF-8 strings are encoded with
+// invalid bytes replaced rather than failing.
+//
+// Supported types are the ones that "CaptureCollector" produces: dict (with
+// string keys), list, tuple, str, unicode, int, long, float, bool and None.
+// Instances of "JsonFragment" are inserted into the output as is.
+//
+// Encoding is split into two phases:
+// 1. "Prepare" walks the object tree. It formats everything except strings
+//    into a skeleton and keeps references to all the strings. This phase
+//    requires Interpreter Lock.
+// 2. "Write" escapes the strings and merges them into the skeleton. This
+//    phase doesn't touch any Python state (strings are immutable and this
+//    class holds a reference to each of them). It can therefore run with
+//    the Interpreter Lock released, which is where most of the time goes for
+//    large breakpoint messages.
+class JsonEncoder;
+
+// Already serialized JSON value. Lets the caller serialize parts of a large
+// message as they are produced and release the source objects early.
+class JsonFragment {
+ public:
+  JsonFragment() {}
+
+  // Wraps JSON string (str object) into a new "JsonFragment" Python object.
+  // The content is not validated.
+  static ScopedPyObject Create(PyObject* json);
+
+  static PyTypeObject python_type_;
+
+ private:
+  // Serialized JSON value (str object).
+  ScopedPyObject json_;
+
+  friend class JsonEncoder;
+
+  DISALLOW_COPY_AND_ASSIGN(JsonFragment);
+};
+
+class JsonEncoder {
+ public:
+  JsonEncoder() : strings_size_(0) {}
+
+  // Walks the object tree. Returns false and sets Python exception if "obj"
+  // can't be serialized. Must be called with Interpreter Lock held.
+  bool Prepare(PyObject* obj);
+
+  // Produces the JSON string. Invalid UTF-8 sequences in "str" objects are
+  // replaced with U+FFFD. Can be called without Interpreter Lock.
+  void Write(string* output) const;
+
+  // Gets the total size of all the strings. This is a lower bound on the
+  // size of the output.
+  size_t strings_size() const { return strings_size_; }
+
+ private:
+  // String to be inserted into the skeleton at the specified position.
+  struct StringReference {
+    size_t position;
+    ScopedPyObject str;
+  };
+
+  // Recursively formats "obj" into the skeleton.
+  bool PrepareValue(PyObject* obj, int depth);
+
+  // Records a string to be escaped and inserted in the "Write" phase.
+  void PrepareString(PyObject* str);
+
+ private:
+  // Everything except strings.
+  string skeleton_;
+
+  // Strings in the order of appearance.
+  std::vector<StringReference> strings_;
+
+  // Total size of all the strings (in characters).
+  size_t strings_size_;
+
+  DISALLOW_COPY_AND_ASSIGN(JsonEncoder);
+};
+
+}  // namespace cdbg
+}  // namespace devtools
+
+#endif  // DEVTOOLS_CDBG_DEBUGLETS_PYTHON_JSON_ENCODER_H_
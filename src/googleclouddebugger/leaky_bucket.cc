@@ -44,11 +44,18 @@ static int64 NowInNanoseconds() {
 
 
 LeakyBucket::LeakyBucket(int64 capacity, int64 fill_rate)
+    : LeakyBucket(capacity, fill_rate, 1.0) {
+}
+
+
+LeakyBucket::LeakyBucket(int64 capacity, int64 fill_rate, double fill_ratio)
     : capacity_(capacity),
       fractional_tokens_(0.0),
       fill_rate_(fill_rate),
       fill_time_ns_(NowInNanoseconds()) {
-  tokens_ = capacity;
+  const double tokens = std::max(0.0, std::min(fill_ratio, 1.0)) * capacity;
+  tokens_ = static_cast<int64>(tokens);
+  fractional_tokens_ = tokens - tokens_;
 }
 
 
@@ -127,5 +134,18 @@ void LeakyBucket::TakeTokens(int64 tokens) {
   }
 }
 
+
+double LeakyBucket::GetFillRatio() {
+  const int64 current_time_ns = NowInNanoseconds();
+
+  std::lock_guard<std::mutex> lock(mu_);
+  const int64 tokens = RefillBucket(AtomicLoadTokens(), current_time_ns);
+  if (capacity_ <= 0) {
+    return 1.0;
+  }
+
+  return (tokens + fractional_tokens_) / capacity_;
+}
+
 }  // namespace cdbg
 }  // namespace devtools
@@ -34,6 +34,10 @@ class LeakyBucket {
   // "fill_rate": The rate which the bucket fills in tokens per second.
   LeakyBucket(int64 capacity, int64 fill_rate);
 
+  // Same as above, but the bucket starts filled to "fill_ratio" (between 0
+  // and 1) of its capacity rather than full.
+  LeakyBucket(int64 capacity, int64 fill_rate, double fill_ratio);
+
   ~LeakyBucket() {}
 
   // Requests tokens from the bucket. If the bucket does not contain enough
@@ -52,6 +56,10 @@ class LeakyBucket {
   // bucket negative.
   void TakeTokens(int64 tokens);
 
+  // Refills the bucket and returns the fraction of its capacity that is
+  // filled, including the fractional tokens.
+  double GetFillRatio();
+
  private:
   // The slow path of RequestTokens. Grabs a lock and may refill tokens_
   // using the fill rate and time passed since last fill.
@@ -0,0 +1,388 @@
+# Copyright 2015 Google Inc. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS-IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Local control socket to set breakpoints without going through the backend.
+
+Breakpoints set through the backend take a long poll round trip to arrive.
+For on-host investigations, the debugger can listen on a Unix domain socket
+instead. Breakpoints set through the socket are armed synchronously and
+their results are streamed back over the same connection.
+
+The protocol is newline delimited JSON messages:
+  client -> debugger: {"set": {<breakpoint definition without ID>}}
+  debugger -> client: {"id": "<assigned breakpoint ID>"}
+  client -> debugger: {"clear": "<breakpoint ID>"}
+  debugger -> client: {"cleared": "<breakpoint ID>"}
+  debugger -> client: {"breakpoint": {<breakpoint update>}}
+  debugger -> client: {"error": "<description>"}
+
+The "id" response is sent once the breakpoint is armed (or deferred until
+the module is loaded). If the breakpoint fails right away (for example due
+to an invalid line), its final update is sent before the "id" response.
+
+Breakpoints are owned by the connection that set them. They are cleared
+when the connection is closed.
+"""
+
+import datetime
+import errno
+import fcntl
+import itertools
+import json
+import os
+import select
+import socket
+import threading
+import time
+import traceback
+
+import cdbg_native as native
+
+# This module catches all exception. This is safe because it runs in
+# a daemon thread (so we are not blocking Ctrl+C).
+# pylint: disable=broad-except
+
+
+class _ConnectionHubClient(object):
+  """Sends updates of locally set breakpoints back to the client."""
+
+  def __init__(self, server, connection):
+    self._server = server
+    self._connection = connection
+
+  def EnqueueBreakpointUpdate(self, breakpoint):
+    self._server._SendBreakpointUpdate(  # pylint: disable=protected-access
+        self._connection, breakpoint)
+
+
+class LocalControlServer(object):
+  """Serves the local control socket.
+
+  This class is thread safe.
+  """
+
+  def __init__(self, socket_path, breakpoints_manager):
+    """Class constructor.
+
+    Args:
+      socket_path: path of the Unix domain socket to listen on.
+      breakpoints_manager: sets and clears the breakpoints.
+    """
+    self._socket_path = socket_path
+    self._breakpoints_manager = breakpoints_manager
+    self._lock = threading.RLock()
+    self._shutdown = False
+    self._thread = None
+    self._pid = os.getpid()
+    self._listener = None
+    self._ids = itertools.count(1)
+
+    # Map of connected clients to the set of breakpoint IDs they own.
+    self._connections = {}
+
+    # Map of connected clients to the list of encoded messages not yet sent.
+    # Only the control thread writes to the sockets, so that threads
+    # completing breakpoints never block on a slow client.
+    self._send_buffers = {}
+
+    # Pipe used to wake up the control thread to send queued messages.
+    self._wakeup_fds = None
+
+    #
+    # Configuration options (constants only modified by unit test)
+    #
+
+    # Time a client may not read queued messages before it is dropped.
+    self.send_timeout_sec = 5
+
+  def Start(self):
+    """Starts listening on the control socket."""
+    try:
+      os.unlink(self._socket_path)
+    except OSError as e:
+      if e.errno != errno.ENOENT:
+        native.LogWarning('Failed to remove %s: %s' % (self._socket_path, e))
+        return
+
+    listener = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    try:
+      listener.bind(self._socket_path)
+      os.chmod(self._socket_path, 0600)
+      listener.listen(16)
+    except (socket.error, OSError) as e:
+      native.LogWarning('Failed to listen on local control socket %s: %s' % (
+          self._socket_path, e))
+      listener.close()
+      return
+
+    self._listener = listener
+    self._shutdown = False
+
+    wakeup_read_fd, wakeup_write_fd = os.pipe()
+    flags = fcntl.fcntl(wakeup_write_fd, fcntl.F_GETFL)
+    fcntl.fcntl(wakeup_write_fd, fcntl.F_SETFL, flags | os.O_NONBLOCK)
+    self._wakeup_fds = (wakeup_read_fd, wakeup_write_fd)
+
+    self._thread = threading.Thread(target=self._MainThreadProc)
+    self._thread.name = 'Cloud Debugger local control'
+    self._thread.daemon = True
+    self._thread.start()
+
+    native.LogInfo('Local control socket listening on %s' % self._socket_path)
+
+  def Stop(self):
+    """Stops the server and clears all locally set breakpoints."""
+    self._shutdown = True
+    if self._thread is not None:
+      self._thread.join()
+      self._thread = None
+
+    for connection in self._connections.keys():
+      self._CloseConnection(connection)
+
+    if self._listener is not None:
+      self._listener.close()
+      self._listener = None
+
+    self._CloseWakeupPipe()
+
+  def AfterFork(self):
+    """Stops serving in a forked child process.
+
+    The socket belongs to the parent process. The child closes its copies of
+    the inherited sockets and clears the breakpoints owned by them.
+    """
+    if self._pid == os.getpid():
+      return  # Not a forked process or already reinitialized.
+
+    self._pid = os.getpid()
+    self._lock = threading.RLock()
+    self._thread = None
+
+    for connection in self._connections.keys():
+      self._CloseConnection(connection)
+
+    if self._listener is not None:
+      self._listener.close()
+      self._listener = None
+
+    self._CloseWakeupPipe()
+
+  def _CloseWakeupPipe(self):
+    with self._lock:
+      wakeup_fds = self._wakeup_fds
+      self._wakeup_fds = None
+
+    if wakeup_fds is not None:
+      for fd in wakeup_fds:
+        os.close(fd)
+
+  def _MainThreadProc(self):
+    """Accepts connections, handles client requests and sends responses."""
+    wakeup_read_fd = self._wakeup_fds[0]
+    buffers = {}
+
+    # Map of clients with queued messages to the time of the last progress
+    # in sending them.
+    send_times = {}
+
+    while not self._shutdown:
+      self._DropStalledConnections(send_times)
+
+      with self._lock:
+        connections = self._connections.keys()
+        sending = [c for c in connections if self._send_buffers.get(c)]
+
+      try:
+        readable, writable, unused_error = select.select(
+            [self._listener, wakeup_read_fd] + connections, sending, [], 1)
+      except (select.error, socket.error):
+        continue  # One of the connections was closed by another thread.
+
+      for s in writable:
+        if self._SendQueuedMessages(s):
+          send_times[s] = time.time()
+
+      for s in readable:
+        if s is self._listener:
+          self._AcceptConnection()
+          continue
+
+        if s is wakeup_read_fd:
+          os.read(wakeup_read_fd, 4096)
+          continue
+
+        try:
+          data = s.recv(65536)
+        except socket.error:
+          data = ''
+
+        if not data:
+          buffers.pop(s, None)
+          send_times.pop(s, None)
+          self._CloseConnection(s)
+          continue
+
+        lines = (buffers.pop(s, '') + data).split('\n')
+        if lines[-1]:
+          buffers[s] = lines[-1]
+
+        for line in lines[:-1]:
+          try:
+            self._HandleRequest(s, json.loads(line))
+          except Exception as e:
+            native.LogWarning('Local control request failed: %s' %
+                              traceback.format_exc())
+            self._Send(s, {'error': str(e)})
+
+  def _AcceptConnection(self):
+    try:
+      connection, unused_address = self._listener.accept()
+    except socket.error:
+      return
+
+    connection.settimeout(self.send_timeout_sec)
+    with self._lock:
+      self._connections[connection] = set()
+
+  def _CloseConnection(self, connection):
+    """Closes the connection and clears breakpoints owned by it.
+
+    Must be called without holding the lock, because clearing breakpoints
+    takes the lock of BreakpointsManager.
+    """
+    with self._lock:
+      breakpoint_ids = self._connections.pop(connection, None)
+      self._send_buffers.pop(connection, None)
+    if breakpoint_ids is None:
+      return  # Already closed.
+
+    connection.close()
+    for breakpoint_id in breakpoint_ids:
+      self._breakpoints_manager.ClearLocalBreakpoint(breakpoint_id)
+
+  def _HandleRequest(self, connection, request):
+    """Handles a single client request."""
+    if 'set' in request:
+      definition = dict(request['set'])
+      definition['id'] = 'local-%d-%d' % (self._pid, next(self._ids))
+      definition['createTime'] = (
+          datetime.datetime.utcnow().strftime('%Y-%m-%dT%H:%M:%S.%fZ'))
+
+      with self._lock:
+        if connection not in self._connections:
+          return
+        self._connections[connection].add(definition['id'])
+
+      self._breakpoints_manager.SetLocalBreakpoint(
+          definition, _ConnectionHubClient(self, connection))
+      self._Send(connection, {'id': definition['id']})
+      return
+
+    if 'clear' in request:
+      breakpoint_id = request['clear']
+      with self._lock:
+        breakpoint_ids = self._connections.get(connection, set())
+        if breakpoint_id not in breakpoint_ids:
+          raise ValueError('Unknown breakpoint %s' % breakpoint_id)
+        breakpoint_ids.remove(breakpoint_id)
+
+      self._breakpoints_manager.ClearLocalBreakpoint(breakpoint_id)
+      self._Send(connection, {'cleared': breakpoint_id})
+      return
+
+    raise ValueError('Unknown request')
+
+  def _SendBreakpointUpdate(self, connection, breakpoint):
+    """Streams breakpoint update to the client that set the breakpoint."""
+    with self._lock:
+      breakpoint_ids = self._connections.get(connection)
+      if breakpoint_ids is None:
+        return  # Client disconnected.
+
+      if breakpoint.get('isFinalState'):
+        breakpoint_ids.discard(breakpoint['id'])
+
+    self._Send(connection, {'breakpoint': breakpoint})
+
+  def _Send(self, connection, message):
+    """Queues a message to the client and wakes up the control thread."""
+    # Breakpoint updates may contain JSON fragments (see CaptureCollector),
+    # which only native.EncodeJson understands.
+    data = native.EncodeJson(message) + '\n'
+    with self._lock:
+      if connection not in self._connections:
+        return  # Client disconnected.
+
+      self._send_buffers.setdefault(connection, []).append(data)
+
+      if self._wakeup_fds is not None:
+        try:
+          os.write(self._wakeup_fds[1], 'x')
+        except OSError as e:
+          if e.errno != errno.EAGAIN:  # The thread is already woken up.
+            raise
+
+  def _SendQueuedMessages(self, connection):
+    """Sends as much of the queued data as the client socket accepts.
+
+    Called on the control thread when the socket is writable. Closes the
+    connection on failure.
+
+    Returns:
+      True if any data was sent.
+    """
+    with self._lock:
+      send_buffer = self._send_buffers.get(connection)
+      if not send_buffer:
+        return False
+      data = ''.join(send_buffer)
+
+    try:
+      sent = connection.send(data)
+    except socket.error as e:
+      native.LogWarning('Local control client dropped: %s' % e)
+      self._CloseConnection(connection)
+      return False
+
+    with self._lock:
+      send_buffer = self._send_buffers.get(connection)
+      if send_buffer is not None:
+        # Other threads might have queued more messages in the meantime.
+        rest = ''.join(send_buffer)[sent:]
+        send_buffer[:] = [rest] if rest else []
+
+    return sent > 0
+
+  def _DropStalledConnections(self, send_times):
+    """Closes connections that didn't read queued messages in time.
+
+    Args:
+      send_times: map of connections to the time of the last progress in
+          sending queued messages. Updated by this function.
+    """
+    with self._lock:
+      sending = [c for c, data in self._send_buffers.iteritems() if data]
+
+    now = time.time()
+    for connection in send_times.keys():
+      if connection not in sending:
+        del send_times[connection]
+
+    for connection in sending:
+      send_time = send_times.setdefault(connection, now)
+      if now - send_time >= self.send_timeout_sec:
+        native.LogWarning('Local control client dropped: send timed out')
+        del send_times[connection]
+        self._CloseConnection(connection)
@@ -0,0 +1,241 @@
+# Copyright 2015 Google Inc. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS-IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Catalog of names of the modules that can be imported.
+
+The catalog holds the base names (without package) of all the modules and
+packages found in the directories of sys.path and their subpackages. It also
+covers the directories of the already loaded modules, since some modules are
+loaded outside of sys.path.
+
+The catalog is built once (typically on a background thread at startup) and
+then refreshed incrementally: a directory is only listed again if its
+modification time changed. A name that is not found triggers a refresh, so
+newly added files and changes to sys.path are picked up without false
+negatives.
+"""
+
+import imp
+import os
+import stat
+import sys
+import threading
+import time
+
+import cdbg_native as native
+
+# Suffixes of the files that can be imported as modules.
+_MODULE_SUFFIXES = tuple(suffix for suffix, _, _ in imp.get_suffixes())
+
+# Serializes scans of the file system. Refreshes are incremental, so
+# concurrent lookups are better off waiting for the running one.
+_lock = threading.Lock()
+
+# Process ID in which _lock was created.
+_pid = os.getpid()
+
+# Map of scanned directories to _Directory objects.
+_directories = {}
+
+# Names of all the modules found in _directories or None if the catalog
+# hasn't been built yet.
+_names = None
+
+
+class _Directory(object):
+  """Scan result of a single directory."""
+
+  def __init__(self, mtime):
+    # Modification time of the directory when it was listed.
+    self.mtime = mtime
+
+    # Names of the modules and packages in the directory.
+    self.names = set()
+
+    # Paths of the subpackages.
+    self.packages = []
+
+    # Map of paths of the subdirectories that aren't packages to their
+    # modification time. A subdirectory becomes a package when __init__.py
+    # is added to it, which only changes the modification time of the
+    # subdirectory.
+    self.other_directories = {}
+
+
+def StartBackgroundScan():
+  """Builds the catalog on a background thread."""
+  thread = threading.Thread(target=Refresh)
+  thread.name = 'Cloud Debugger module catalog'
+  thread.daemon = True
+  thread.start()
+
+
+def Contains(module_name):
+  """Checks whether a module with the specified base name can be imported.
+
+  Waits for the catalog to be built if the background scan hasn't completed
+  yet.
+
+  Args:
+    module_name: name of the module or package without the parent package.
+
+  Returns:
+    True if a module or a package with this name exists in the catalog.
+  """
+  names = _names
+  if names is not None and module_name in names:
+    return True  # Common case, no need to lock.
+
+  return module_name in Refresh()
+
+
+def Refresh():
+  """Updates the catalog, only listing directories that have changed.
+
+  Returns:
+    Set of names of all the modules in the catalog.
+  """
+  global _lock
+  global _pid
+  global _directories
+  global _names
+
+  if _pid != os.getpid():
+    # The lock might have been held by a thread that doesn't exist in the
+    # forked child process.
+    _pid = os.getpid()
+    _lock = threading.Lock()
+
+  with _lock:
+    start_time = time.time()
+    listed_count = [0]
+
+    def GetDirectory(path):
+      """Gets the up to date scan result of the directory or None."""
+      try:
+        mtime = os.stat(path).st_mtime
+      except OSError:
+        return None  # Doesn't exist or not a directory.
+
+      directory = _directories.get(path)
+      if (directory is None or directory.mtime != mtime or
+          _HasNewPackages(directory)):
+        listed_count[0] += 1
+        directory = _ListDirectory(path, mtime)
+
+      return directory
+
+    directories = {}
+
+    # Recursively discover all the subpackages in all the Python paths.
+    pending = [path or os.curdir for path in sys.path]
+    while pending:
+      path = pending.pop()
+      if path in directories:
+        continue
+
+      directory = GetDirectory(path)
+      if directory is not None:
+        directories[path] = directory
+        pending.extend(directory.packages)
+
+    # Add directories where some modules have already been loaded. We don't
+    # discover subpackages of these, which takes a lot of time in some edge
+    # cases and is not worth it.
+    for module in sys.modules.values():
+      file_path = getattr(module, '__file__', None)
+      if not file_path:
+        continue
+
+      path = os.path.dirname(file_path) or sys.path[0] or os.curdir
+      if path not in directories:
+        directory = GetDirectory(path)
+        if directory is not None:
+          directories[path] = directory
+
+    if (_names is None or listed_count[0] or
+        directories.viewkeys() != _directories.viewkeys()):
+      names = set()
+      for directory in directories.itervalues():
+        names |= directory.names
+      _names = frozenset(names)
+
+    _directories = directories
+
+    if listed_count[0]:
+      native.LogInfo(
+          ('Module catalog refreshed in %f ms: %d names, %d directories, '
+           '%d listed') % (
+               (time.time() - start_time) * 1000,
+               len(_names),
+               len(directories),
+               listed_count[0]))
+
+    return _names
+
+
+def _ListDirectory(path, mtime):
+  """Lists the modules, packages and other subdirectories of the directory."""
+  directory = _Directory(mtime)
+
+  try:
+    file_names = os.listdir(path)
+  except OSError:
+    return directory
+
+  for name in file_names:
+    if '.' not in name:
+      # Package names can't have dots, so this can be a package.
+      subpath = os.path.join(path, name)
+      try:
+        subpath_stat = os.stat(subpath)
+      except OSError:
+        continue
+
+      if not stat.S_ISDIR(subpath_stat.st_mode):
+        continue
+
+      if _IsPackage(subpath):
+        directory.names.add(name)
+        directory.packages.append(subpath)
+      else:
+        directory.other_directories[subpath] = subpath_stat.st_mtime
+      continue
+
+    for suffix in _MODULE_SUFFIXES:
+      if name.endswith(suffix):
+        directory.names.add(name[:-len(suffix)])
+        break
+
+  return directory
+
+
+def _HasNewPackages(directory):
+  """Checks whether any of the subdirectories that aren't packages changed."""
+  for path, mtime in directory.other_directories.iteritems():
+    try:
+      if os.stat(path).st_mtime != mtime:
+        return True
+    except OSError:
+      return True
+
+  return False
+
+
+def _IsPackage(path):
+  """Checks if the specified directory is a valid Python package."""
+  init_base_path = os.path.join(path, '__init__.py')
+  return (os.path.isfile(init_base_path) or
+          os.path.isfile(init_base_path + 'c') or
+          os.path.isfile(init_base_path + 'o'))
@@ -46,14 +46,35 @@ def GetCodeObjectAtLine(module, line):
   Returns:
     Code object or None if not found.
   """
+  return GetCodeObjectsAtLines(module, [line])[line]
+
+
+def GetCodeObjectsAtLines(module, lines):
+  """Searches for code objects at multiple lines of the same module.
+
+  The module is only explored once, which is the expensive part of the
+  search.
+
+  Args:
+    module: module to explore.
+    lines: iterable of 1-based line numbers.
+
+  Returns:
+    Dictionary mapping each line to the code object at that line or to None
+    if not found.
+  """
+  result = dict.fromkeys(lines)
   if not hasattr(module, '__file__'):
-    return None
+    return result
 
-  for code_object in _GetModuleCodeObjects(module):
-    if native.HasSourceLine(code_object, line):
-      return code_object
+  code_objects = _GetModuleCodeObjects(module)
+  for line in result:
+    for code_object in code_objects:
+      if native.HasSourceLine(code_object, line):
+        result[line] = code_object
+        break
 
-  return None
+  return result
 
 
 def _GetModuleCodeObjects(module):
@@ -33,25 +33,62 @@ def FindModule(source_path):
   Returns:
     Module object that best matches the source_path or None if no match found.
   """
-  file_name, ext = os.path.splitext(os.path.basename(source_path))
-  if ext != '.py':
-    return None  # ".py" extension is expected
+  return FindModules([source_path])[source_path]
 
-  candidates = _GetModulesByFileName(file_name)
-  if not candidates:
-    return None
 
-  if len(candidates) == 1:
-    return candidates[0]
+def FindModules(source_paths):
+  """Finds the loaded modules for multiple source paths.
 
-  return candidates[_Disambiguate(
-      os.path.split(source_path)[0],
-      [os.path.split(module.__file__)[0] for module in candidates])]
+  The loaded modules are only enumerated once for all the paths.
 
+  Args:
+    source_paths: iterable of source file paths as specified in breakpoints.
+
+  Returns:
+    Dictionary mapping each source path to the module object that best
+    matches it or to None if no match found.
+  """
+  result = dict.fromkeys(source_paths)
+
+  lookup_file_names = set()
+  for source_path in result:
+    file_name, ext = os.path.splitext(os.path.basename(source_path))
+    if ext == '.py':  # ".py" extension is expected
+      lookup_file_names.add(file_name)
+
+  if not lookup_file_names:
+    return result
+
+  candidates = _GetModulesByFileName(lookup_file_names)
+
+  for source_path in result:
+    file_name, ext = os.path.splitext(os.path.basename(source_path))
+    if ext != '.py' or file_name not in candidates:
+      continue
+
+    modules = candidates[file_name]
+    if len(modules) == 1:
+      result[source_path] = modules[0]
+      continue
 
-def _GetModulesByFileName(lookup_file_name):
-  """Gets list of all the loaded modules by file name (ignores directory)."""
-  matches = []
+    result[source_path] = modules[_Disambiguate(
+        os.path.split(source_path)[0],
+        [os.path.split(module.__file__)[0] for module in modules])]
+
+  return result
+
+
+def _GetModulesByFileName(lookup_file_names):
+  """Gets all the loaded modules by file name (ignores directory).
+
+  Args:
+    lookup_file_names: set of file names without extension.
+
+  Returns:
+    Dictionary mapping file name to the list of matching modules. File names
+    without any matching module are omitted.
+  """
+  matches = {}
 
   # Clone modules dictionaries to allow new modules to load during iteration.
   for unused_name, module in sys.modules.copy().iteritems():
@@ -59,8 +96,8 @@ def _GetModulesByFileName(lookup_file_name):
       continue  # This is a built-in module.
 
     file_name, ext = os.path.splitext(os.path.basename(module.__file__))
-    if file_name == lookup_file_name and (ext == '.py' or ext == '.pyc'):
-      matches.append(module)
+    if file_name in lookup_file_names and (ext == '.py' or ext == '.pyc'):
+      matches.setdefault(file_name, []).append(module)
 
   return matches
 
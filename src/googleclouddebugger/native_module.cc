@@ -18,16 +18,29 @@
 #include "common.h"
 
 #include "bytecode_breakpoint.h"
+#include "code_metadata_cache.h"
 #include "common.h"
 #include "conditional_breakpoint.h"
+#include "heap_census.h"
 #include "immutability_tracer.h"
+#include "json_encoder.h"
 #include "native_module.h"
 #include "python_callback.h"
+#include "request_tag.h"
 #include "python_util.h"
 #include "rate_limit.h"
+#include "sampling_profiler.h"
+
+#include <pthread.h>
 
 using google::LogMessage;
 
+DEFINE_int32(
+    json_encoder_release_gil_threshold,
+    16 * 1024,
+    "minimum total size of strings in a breakpoint message for the JSON "
+    "encoder to release the Interpreter Lock while escaping them");
+
 namespace devtools {
 namespace cdbg {
 
@@ -60,6 +73,22 @@ static const INTEGER_CONSTANT kIntegerConstants[] = {
   {
     "BREAKPOINT_EVENT_CONDITION_EXPRESSION_MUTABLE",
     static_cast<int32>(BreakpointEvent::ConditionExpressionMutable)
+  },
+  {
+    "BREAKPOINT_EVENT_OWNER_CONDITION_QUOTA_EXCEEDED",
+    static_cast<int32>(BreakpointEvent::OwnerConditionQuotaExceeded)
+  },
+  {
+    "BREAKPOINT_EVENT_MODULE_CONDITION_QUOTA_EXCEEDED",
+    static_cast<int32>(BreakpointEvent::ModuleConditionQuotaExceeded)
+  },
+  {
+    "EXPRESSION_KIND_WATCH",
+    static_cast<int32>(ExpressionKind::WatchExpression)
+  },
+  {
+    "EXPRESSION_KIND_LOG",
+    static_cast<int32>(ExpressionKind::LogExpression)
   }
 };
 
@@ -83,6 +112,11 @@ static BytecodeBreakpoint g_bytecode_breakpoint;
 // threaded.
 static std::unique_ptr<LeakyBucket> g_global_condition_quota_;
 
+// On-demand sampling profiler. Created on first use and never destroyed:
+// the sampling thread might still be waiting for Interpreter Lock when the
+// module is unloaded.
+static SamplingProfiler* g_sampling_profiler = nullptr;
+
 // Initializes C++ flags and logging.
 //
 // This function should be called exactly once during debugger bootstrap. It
@@ -255,6 +289,10 @@ static PyObject* HasSourceLine(PyObject* self, PyObject* py_args) {
 //   callback: callable object to invoke on breakpoint event. The callable is
 //       invoked with two arguments: (event, frame). See "BreakpointFn" for more
 //       details.
+//   request_tag: optional request tag (see "SetRequestTag") of the threads
+//       on which the breakpoint fires or None to fire on all threads.
+//   owner: optional string identifying the user that set the breakpoint.
+//       Breakpoints of the same owner share the owner's condition quota.
 //
 // Returns:
 //   Integer cookie identifying this breakpoint. It needs to be specified when
@@ -264,8 +302,11 @@ static PyObject* SetConditionalBreakpoint(PyObject* self, PyObject* py_args) {
   int line = -1;
   PyCodeObject* condition = nullptr;
   PyObject* callback = nullptr;
-  if (!PyArg_ParseTuple(py_args, "OiOO",
-                        &code_object, &line, &condition, &callback)) {
+  PyObject* request_tag = Py_None;
+  PyObject* owner = Py_None;
+  if (!PyArg_ParseTuple(py_args, "OiOO|OO",
+                        &code_object, &line, &condition, &callback,
+                        &request_tag, &owner)) {
     return nullptr;
   }
 
@@ -290,13 +331,43 @@ static PyObject* SetConditionalBreakpoint(PyObject* self, PyObject* py_args) {
     return nullptr;
   }
 
+  ScopedPyObject canonical_request_tag;
+  if (request_tag != Py_None) {
+    canonical_request_tag = NormalizeRequestTag(request_tag);
+    if (canonical_request_tag == nullptr) {
+      return nullptr;
+    }
+  }
+
+  string owner_id;
+  if (PyUnicode_Check(owner)) {
+    ScopedPyObject owner_utf8(PyUnicode_AsUTF8String(owner));
+    if (owner_utf8 == nullptr) {
+      return nullptr;
+    }
+
+    owner_id = PyString_AS_STRING(owner_utf8.get());
+  } else if (PyString_Check(owner)) {
+    owner_id = PyString_AS_STRING(owner);
+  } else if (owner != Py_None) {
+    PyErr_SetString(PyExc_TypeError, "owner must be None or a string");
+    return nullptr;
+  }
+
   // Rate limiting has to be initialized before it is used for the first time.
   // We can't initialize it on module start because it happens before the
   // command line is parsed and flags are still at their default values.
   LazyInitializeRateLimit();
 
+  // Conditions are accounted per module (source file) of the breakpoint.
+  std::unique_ptr<ConditionQuota> condition_quota(new ConditionQuota(
+      owner_id,
+      PyString_AsString(code_object->co_filename)));
+
   auto conditional_breakpoint = std::make_shared<ConditionalBreakpoint>(
       ScopedPyCodeObject::NewReference(condition),
+      canonical_request_tag,
+      std::move(condition_quota),
       ScopedPyObject::NewReference(callback));
 
   int cookie = -1;
@@ -347,13 +418,22 @@ static PyObject* ClearConditionalBreakpoint(PyObject* self, PyObject* py_args) {
 // Args:
 //   frame: defines the evaluation context.
 //   code: code object to invoke.
+//   kind: optional EXPRESSION_KIND_XXX constant selecting the time limits
+//       (defaults to EXPRESSION_KIND_WATCH).
 //
 // Returns:
 //   Return value of the callable.
 static PyObject* CallImmutable(PyObject* self, PyObject* py_args) {
   PyObject* obj_frame = nullptr;
   PyObject* obj_code = nullptr;
-  if (!PyArg_ParseTuple(py_args, "OO", &obj_frame, &obj_code)) {
+  int kind = static_cast<int>(ExpressionKind::WatchExpression);
+  if (!PyArg_ParseTuple(py_args, "OO|i", &obj_frame, &obj_code, &kind)) {
+    return nullptr;
+  }
+
+  if ((kind != static_cast<int>(ExpressionKind::WatchExpression)) &&
+      (kind != static_cast<int>(ExpressionKind::LogExpression))) {
+    PyErr_SetString(PyExc_ValueError, "invalid expression kind");
     return nullptr;
   }
 
@@ -372,11 +452,305 @@ static PyObject* CallImmutable(PyObject* self, PyObject* py_args) {
 
   PyFrame_FastToLocals(frame);
 
-  ScopedImmutabilityTracer immutability_tracer;
+  ScopedImmutabilityTracer immutability_tracer(
+      static_cast<ExpressionKind>(kind));
   return PyEval_EvalCode(code, frame->f_globals, frame->f_locals);
 }
 
 
+// Serializes breakpoint message into compact JSON string.
+//
+// Strings are escaped with the Interpreter Lock released, so that application
+// threads can run while large breakpoint messages are being serialized.
+//
+// Args:
+//   obj: dictionary, list or primitive value to serialize.
+//
+// Returns:
+//   JSON string (str object).
+//
+// Raises:
+//   TypeError: "obj" contains a value that can't be serialized.
+//   ValueError: "obj" is nested too deeply (or has a reference cycle).
+static PyObject* EncodeJson(PyObject* self, PyObject* py_args) {
+  PyObject* obj = nullptr;
+  if (!PyArg_ParseTuple(py_args, "O", &obj)) {
+    return nullptr;
+  }
+
+  JsonEncoder encoder;
+  if (!encoder.Prepare(obj)) {
+    return nullptr;
+  }
+
+  string json;
+  if (encoder.strings_size() >=
+      static_cast<size_t>(FLAGS_json_encoder_release_gil_threshold)) {
+    Py_BEGIN_ALLOW_THREADS
+    encoder.Write(&json);
+    Py_END_ALLOW_THREADS
+  } else {
+    encoder.Write(&json);
+  }
+
+  return PyString_FromStringAndSize(json.data(), json.size());
+}
+
+
+// Sets the request tag of the current thread. Breakpoints with a request tag
+// only fire on threads with the same tag.
+//
+// Args:
+//   tag: str, unicode or int tag or None to clear the tag.
+static PyObject* SetRequestTag(PyObject* self, PyObject* py_args) {
+  PyObject* tag = nullptr;
+  if (!PyArg_ParseTuple(py_args, "O", &tag)) {
+    return nullptr;
+  }
+
+  if (!SetRequestTag(tag)) {
+    return nullptr;
+  }
+
+  Py_RETURN_NONE;
+}
+
+
+// Wraps already serialized JSON value, so that "EncodeJson" inserts it into
+// the output as is.
+//
+// Args:
+//   json: JSON string (str object).
+//
+// Returns:
+//   Opaque object to be placed in the message passed to "EncodeJson".
+static PyObject* CreateJsonFragment(PyObject* self, PyObject* py_args) {
+  PyObject* json = nullptr;
+  if (!PyArg_ParseTuple(py_args, "S", &json)) {
+    return nullptr;
+  }
+
+  return JsonFragment::Create(json).release();
+}
+
+
+// Abandons the sampling profiler in a forked child process. The sampling
+// thread doesn't exist in the child process, so the profiler object (and
+// its mutex) is intentionally leaked.
+static void ResetSamplingProfilerInChildProcess() {
+  g_sampling_profiler = nullptr;
+}
+
+
+// Starts sampling call stacks of all Python threads on a native thread.
+//
+// Args:
+//   sampling_rate_hz: number of samples per second.
+//   duration_sec: sampling stops automatically after this time.
+//   cpu_only: if True, only threads that consumed CPU since the previous
+//       sample are sampled.
+//
+// Returns:
+//   True if the profiler started or False if it is already running.
+static PyObject* StartProfiler(PyObject* self, PyObject* py_args) {
+  int sampling_rate_hz = 0;
+  double duration_sec = 0;
+  PyObject* cpu_only = nullptr;
+  if (!PyArg_ParseTuple(py_args, "idO",
+                        &sampling_rate_hz, &duration_sec, &cpu_only)) {
+    return nullptr;
+  }
+
+  if ((sampling_rate_hz <= 0) || (sampling_rate_hz > 10000)) {
+    PyErr_SetString(PyExc_ValueError, "sampling_rate_hz out of range");
+    return nullptr;
+  }
+
+  if (duration_sec <= 0) {
+    PyErr_SetString(PyExc_ValueError, "duration_sec must be positive");
+    return nullptr;
+  }
+
+  if (g_sampling_profiler == nullptr) {
+    static bool fork_handler_registered = false;
+    if (!fork_handler_registered) {
+      pthread_atfork(nullptr, nullptr, ResetSamplingProfilerInChildProcess);
+      fork_handler_registered = true;
+    }
+
+    g_sampling_profiler = new SamplingProfiler;
+  }
+
+  if (!g_sampling_profiler->Start(
+          sampling_rate_hz,
+          duration_sec,
+          PyObject_IsTrue(cpu_only))) {
+    Py_RETURN_FALSE;
+  }
+
+  Py_RETURN_TRUE;
+}
+
+
+// Stops the sampling profiler started by "StartProfiler" and returns the
+// collected stacks. No-op if the profiler is not running.
+//
+// Returns:
+//   Tuple of the number of samples and a string with one line per unique
+//   stack in the collapsed stack format:
+//       outer_function (file.py:10);inner_function (file.py:20) 17
+static PyObject* StopProfiler(PyObject* self, PyObject* py_args) {
+  string collapsed_stacks;
+  int64 sample_count = 0;
+
+  if (g_sampling_profiler != nullptr) {
+    g_sampling_profiler->Stop(&collapsed_stacks, &sample_count);
+  }
+
+  return Py_BuildValue(
+      "(Ls#)",
+      static_cast<PY_LONG_LONG>(sample_count),
+      collapsed_stacks.data(),
+      static_cast<int>(collapsed_stacks.size()));
+}
+
+
+// Counts live Python objects and their approximate sizes per type.
+//
+// The limits don't bound the list of all the tracked objects that the census
+// builds first (see heap_census.h), so memory usage spikes by a pointer per
+// tracked object while the census runs.
+//
+// Args:
+//   max_objects: maximum number of objects to count.
+//   max_time_sec: maximum wall clock time to spend (with the Interpreter Lock
+//       held).
+//   top_types: number of types to return.
+//
+// Returns:
+//   Tuple of (object_count, total_size, truncated, top_types) where
+//   "top_types" is a list of (type_name, count, size) tuples of the types
+//   with the largest total size.
+static PyObject* TakeHeapCensus(PyObject* self, PyObject* py_args) {
+  PY_LONG_LONG max_objects = 0;
+  double max_time_sec = 0;
+  int top_types = 0;
+  if (!PyArg_ParseTuple(py_args, "Ldi",
+                        &max_objects, &max_time_sec, &top_types)) {
+    return nullptr;
+  }
+
+  HeapCensus census(
+      max_objects,
+      static_cast<int64>(max_time_sec * 1000000000LL));
+  if (!census.Run()) {
+    return nullptr;
+  }
+
+  std::vector<HeapCensus::TypeStats> types = census.GetTopTypes(top_types);
+
+  ScopedPyObject types_list(PyList_New(types.size()));
+  if (types_list == nullptr) {
+    return nullptr;
+  }
+
+  for (size_t i = 0; i < types.size(); ++i) {
+    PyObject* item = Py_BuildValue(
+        "(sLL)",
+        types[i].name.c_str(),
+        static_cast<PY_LONG_LONG>(types[i].count),
+        static_cast<PY_LONG_LONG>(types[i].size));
+    if (item == nullptr) {
+      return nullptr;
+    }
+
+    PyList_SET_ITEM(types_list.get(), i, item);
+  }
+
+  return Py_BuildValue(
+      "(LLOO)",
+      static_cast<PY_LONG_LONG>(census.object_count()),
+      static_cast<PY_LONG_LONG>(census.total_size()),
+      census.truncated() ? Py_True : Py_False,
+      types_list.get());
+}
+
+
+// Gets metadata of a code object from the cache, computing it on cache miss.
+//
+// Args:
+//   code_object: Python code object.
+//   factory: callable computing the metadata from the code object.
+//
+// Returns:
+//   Cached metadata (the object returned by "factory").
+static PyObject* GetCodeMetadata(PyObject* self, PyObject* py_args) {
+  PyObject* code_object = nullptr;
+  PyObject* factory = nullptr;
+  if (!PyArg_ParseTuple(py_args, "OO", &code_object, &factory)) {
+    return nullptr;
+  }
+
+  if (!PyCode_Check(code_object)) {
+    PyErr_SetString(PyExc_TypeError, "code_object must be a code object");
+    return nullptr;
+  }
+
+  return GetCodeMetadata(
+      reinterpret_cast<PyCodeObject*>(code_object),
+      factory);
+}
+
+
+// Removes all the entries from the code object metadata cache.
+static PyObject* ClearCodeMetadataCache(PyObject* self, PyObject* py_args) {
+  ClearCodeMetadataCache();
+  Py_RETURN_NONE;
+}
+
+
+// Approximates the memory used by the native subsystems of the debugger.
+//
+// Returns:
+//   Dictionary mapping subsystem name to the number of bytes it uses.
+static PyObject* GetMemoryStats(PyObject* self, PyObject* py_args) {
+  const struct {
+    const char* name;
+    int64 size;
+  } stats[] = {
+    {
+      "bytecode_breakpoints",
+      g_bytecode_breakpoint.GetMemoryUsage()
+    },
+    {
+      "code_metadata_cache",
+      GetCodeMetadataCacheMemoryUsage()
+    },
+    {
+      "sampling_profiler",
+      (g_sampling_profiler != nullptr)
+          ? g_sampling_profiler->GetMemoryUsage()
+          : 0
+    }
+  };
+
+  ScopedPyObject result(PyDict_New());
+  if (result == nullptr) {
+    return nullptr;
+  }
+
+  for (const auto& stat : stats) {
+    ScopedPyObject size(PyLong_FromLongLong(stat.size));
+    if ((size == nullptr) ||
+        (PyDict_SetItemString(result.get(), stat.name, size.get()) != 0)) {
+      return nullptr;
+    }
+  }
+
+  return result.release();
+}
+
+
 static PyMethodDef g_module_functions[] = {
   {
     "InitializeModule",
@@ -427,10 +801,85 @@ static PyMethodDef g_module_functions[] = {
     METH_VARARGS,
     "Invokes a Python callable object with immutability tracer."
   },
+  {
+    "EncodeJson",
+    EncodeJson,
+    METH_VARARGS,
+    "Serializes breakpoint message into compact JSON string."
+  },
+  {
+    "SetRequestTag",
+    SetRequestTag,
+    METH_VARARGS,
+    "Sets the request tag of the current thread."
+  },
+  {
+    "CreateJsonFragment",
+    CreateJsonFragment,
+    METH_VARARGS,
+    "Wraps already serialized JSON value to be inserted by EncodeJson as is."
+  },
+  {
+    "StartProfiler",
+    StartProfiler,
+    METH_VARARGS,
+    "Starts sampling call stacks of all Python threads."
+  },
+  {
+    "StopProfiler",
+    StopProfiler,
+    METH_VARARGS,
+    "Stops the sampling profiler and returns the collected stacks."
+  },
+  {
+    "TakeHeapCensus",
+    TakeHeapCensus,
+    METH_VARARGS,
+    "Counts live Python objects and their sizes per type."
+  },
+  {
+    "GetCodeMetadata",
+    GetCodeMetadata,
+    METH_VARARGS,
+    "Gets cached metadata of a code object."
+  },
+  {
+    "GetMemoryStats",
+    GetMemoryStats,
+    METH_NOARGS,
+    "Approximates memory used by the native subsystems of the debugger."
+  },
+  {
+    "ClearCodeMetadataCache",
+    ClearCodeMetadataCache,
+    METH_NOARGS,
+    "Clears the cache of code object metadata."
+  },
   { nullptr, nullptr, 0, nullptr }  // sentinel
 };
 
 
+// Registers the module function "name" with the "atexit" module.
+static bool RegisterAtExit(PyObject* module, const char* name) {
+  ScopedPyObject atexit_module(PyImport_ImportModule("atexit"));
+  if (atexit_module == nullptr) {
+    return false;
+  }
+
+  ScopedPyObject function(PyObject_GetAttrString(module, name));
+  if (function == nullptr) {
+    return false;
+  }
+
+  ScopedPyObject rc(PyObject_CallMethod(
+      atexit_module.get(),
+      const_cast<char*>("register"),
+      const_cast<char*>("O"),
+      function.get()));
+  return rc != nullptr;
+}
+
+
 void InitDebuggerNativeModule() {
   PyObject* module = Py_InitModule3(
       CDBG_MODULE_NAME,
@@ -440,7 +889,8 @@ void InitDebuggerNativeModule() {
   SetDebugletModule(module);
 
   if (!RegisterPythonType<PythonCallback>() ||
-      !RegisterPythonType<ImmutabilityTracer>()) {
+      !RegisterPythonType<ImmutabilityTracer>() ||
+      !RegisterPythonType<JsonFragment>()) {
     return;
   }
 
@@ -455,6 +905,22 @@ void InitDebuggerNativeModule() {
       return;
     }
   }
+
+  // The sampling thread acquires Interpreter Lock, so it has to be stopped
+  // and joined before the interpreter is finalized.
+  if (!RegisterAtExit(module, "StopProfiler")) {
+    LOG(ERROR) << "Failed to register sampling profiler exit handler";
+    PyErr_Clear();
+  }
+
+  // Code objects that are still patched at exit are released after the
+  // interpreter is finalized (by the destructor of "g_bytecode_breakpoint").
+  // Clearing weak references of a code object at that point crashes, so the
+  // cache has to drop its weak references while the interpreter is alive.
+  if (!RegisterAtExit(module, "ClearCodeMetadataCache")) {
+    LOG(ERROR) << "Failed to register code metadata cache exit handler";
+    PyErr_Clear();
+  }
 }
 
 }  // namespace cdbg
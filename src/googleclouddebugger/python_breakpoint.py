@@ -17,6 +17,7 @@
 from datetime import datetime
 from datetime import timedelta
 import os
+import sys
 from threading import Lock
 
 import capture_collector
@@ -39,12 +40,30 @@ BREAKPOINT_CONDITION_QUOTA_EXCEEDED = (
     'Snapshot cancelled. The condition evaluation at this location might '
     'affect application performance. Please simplify the condition or move '
     'the snapshot to a less frequently called statement.')
+OWNER_CONDITION_QUOTA_EXCEEDED = (
+    'Snapshot cancelled. The condition evaluation cost of all the snapshots '
+    'set by the same user might affect the application performance.')
+MODULE_CONDITION_QUOTA_EXCEEDED = (
+    'Snapshot cancelled. The condition evaluation cost of all the snapshots '
+    'in this file might affect the application performance.')
 MUTABLE_CONDITION = (
     'Only immutable expressions can be used in snapshot conditions')
 BREAKPOINT_EXPIRED = (
     'The snapshot has expired')
 INTERNAL_ERROR = (
     'Internal error occurred')
+SERIALIZATION_ERROR = (
+    'Failed to serialize the snapshot data')
+INVALID_REQUEST_TAG = (
+    'Request tag must be a string or an integer')
+AGENT_MEMORY_LIMIT_EXCEEDED = (
+    'The debugger agent has reached its memory limit. Please remove some of '
+    'the active snapshots and logpoints.')
+
+# Interval of logging summaries of repeated logpoint messages. The timer runs
+# on the thread checking breakpoints expiration, so the actual interval might
+# be longer.
+LOG_DEDUPLICATION_PERIOD = timedelta(seconds=10)
 
 # Status messages for different breakpoint events (except of "hit").
 _BREAKPOINT_EVENT_STATUS = dict(
@@ -62,7 +81,15 @@ _BREAKPOINT_EVENT_STATUS = dict(
      (native.BREAKPOINT_EVENT_CONDITION_EXPRESSION_MUTABLE,
       {'isError': True,
        'refersTo': 'BREAKPOINT_CONDITION',
-       'description': {'format': MUTABLE_CONDITION}})])
+       'description': {'format': MUTABLE_CONDITION}}),
+     (native.BREAKPOINT_EVENT_OWNER_CONDITION_QUOTA_EXCEEDED,
+      {'isError': True,
+       'refersTo': 'BREAKPOINT_CONDITION',
+       'description': {'format': OWNER_CONDITION_QUOTA_EXCEEDED}}),
+     (native.BREAKPOINT_EVENT_MODULE_CONDITION_QUOTA_EXCEEDED,
+      {'isError': True,
+       'refersTo': 'BREAKPOINT_CONDITION',
+       'description': {'format': MODULE_CONDITION_QUOTA_EXCEEDED}})])
 
 
 class PythonBreakpoint(object):
@@ -74,18 +101,23 @@ class PythonBreakpoint(object):
   to log a statement.
   """
 
-  def __init__(self, definition, hub_client, breakpoints_manager):
+  def __init__(self, definition, hub_client, breakpoints_manager,
+               memory_limit_exceeded=False):
     """Class constructor.
 
-    Tries to set the breakpoint. If the source location is invalid, the
-    breakpoint is completed with an error message. If the source location is
-    valid, but the module hasn't been loaded yet, the breakpoint is initialized
-    as deferred.
+    The breakpoint is not set until BreakpointsManager takes it through the
+    activation stages (see Resolve, Compile and Patch). If the source location
+    is invalid, the breakpoint is completed with an error message. If the
+    source location is valid, but the module hasn't been loaded yet, the
+    breakpoint is deferred.
 
     Args:
       definition: breakpoint definition as it came from the backend.
       hub_client: asynchronously sends breakpoint updates to the backend.
       breakpoints_manager: parent object managing active breakpoints.
+      memory_limit_exceeded: if True, the debugger is over its memory limit
+          (see BreakpointsManager.IsMemoryLimitExceeded) and the breakpoint
+          is completed with an error right away.
     """
     self.definition = definition
 
@@ -97,11 +129,32 @@ class PythonBreakpoint(object):
     self._cookie = None
     self._import_hook_cleanup = None
 
+    # Results of the activation stages.
+    self._code_object = None
+    self._condition = None
+
     self._lock = Lock()
     self._completed = False
 
-    if not self._TryActivateBreakpoint() and not self._completed:
-      self._DeferBreakpoint()
+    # Logpoints suppress repeated messages and periodically log how many
+    # times each of them was repeated.
+    self._log_deduplicator = None
+    self._log_flush_timer = None
+
+    if memory_limit_exceeded:
+      self._CompleteBreakpoint({
+          'status': {
+              'isError': True,
+              'refersTo': 'UNSPECIFIED',
+              'description': {'format': AGENT_MEMORY_LIMIT_EXCEEDED}}})
+      return
+
+    if self.definition.get('action') == 'LOG':
+      self._log_deduplicator = capture_collector.LogDeduplicator()
+      self._log_flush_timer = breakpoints_manager.ScheduleTimer(
+          LOG_DEDUPLICATION_PERIOD,
+          self._log_deduplicator.Flush,
+          periodic=True)
 
   def Clear(self):
     """Clears the breakpoint and releases all breakpoint resources.
@@ -109,13 +162,20 @@ class PythonBreakpoint(object):
     This function is assumed to be called by BreakpointsManager. Therefore we
     don't call CompleteBreakpoint from here.
     """
+    # Mark the breakpoint completed first, so that an activation running on
+    # another thread doesn't leave the breakpoint set (see Patch).
+    self._completed = True  # Never again send updates for this breakpoint.
+
     self._RemoveImportHook()
     if self._cookie is not None:
       native.LogInfo('Clearing breakpoint %s' % self.GetBreakpointId())
       native.ClearConditionalBreakpoint(self._cookie)
       self._cookie = None
 
-    self._completed = True  # Never again send updates for this breakpoint.
+    if self._log_flush_timer is not None:
+      self._breakpoints_manager.CancelTimer(self._log_flush_timer)
+      self._log_flush_timer = None
+      self._log_deduplicator.Flush()
 
   def GetBreakpointId(self):
     return self.definition['id']
@@ -139,34 +199,58 @@ class PythonBreakpoint(object):
             'refersTo': 'UNSPECIFIED',
             'description': {'format': BREAKPOINT_EXPIRED}}})
 
-  def _TryActivateBreakpoint(self):
-    """Sets the breakpoint if the module has already been loaded.
-
-    This function will complete the breakpoint with error if breakpoint
-    definition is incorrect. Examples: invalid line or bad condition.
+  def Resolve(self, module, code_object):
+    """First activation stage: takes the result of the location lookup.
 
-    If the code object corresponding to the source path can't be found,
-    this function returns False. In this case, the breakpoint is not
-    completed, since the breakpoint may be deferred.
+    Args:
+      module: loaded module matching the breakpoint path or None if there is
+          no such module loaded.
+      code_object: code object at the breakpoint line in "module" or None if
+          there is no code at this line.
 
     Returns:
-      True if breakpoint was set or false otherwise. False can be returned
-      for potentially deferred breakpoints or in case of a bad breakpoint
-      definition. The self._completed flag distinguishes between the two cases.
+      True if the breakpoint is ready for the next stage. False if the
+      breakpoint has been completed (for example with an error) or deferred
+      until the module is loaded.
     """
+    if self._completed:
+      return False
+
+    if module is None:
+      self._DeferBreakpoint()
+      return False
+
+    if code_object is None:
+      self._CompleteBreakpoint({
+          'status': {
+              'isError': True,
+              'refersTo': 'BREAKPOINT_SOURCE_LOCATION',
+              'description': {
+                  'format': NO_CODE_FOUND_AT_LINE,
+                  'parameters': [str(self.definition['location']['line'])]}}})
+      return False
 
-    # Find the code object in which the breakpoint is being set.
-    code_object = self._FindCodeObject()
-    if not code_object:
+    self._code_object = code_object
+    return True
+
+  def Compile(self):
+    """Second activation stage: compiles the breakpoint condition.
+
+    This function will complete the breakpoint with error if the condition
+    or the request tag are invalid.
+
+    Returns:
+      True if the breakpoint is ready to be set or False if it has been
+      completed.
+    """
+    if self._completed:
       return False
 
-    # Compile the breakpoint condition.
-    condition = None
     if self.definition.get('condition'):
       try:
-        condition = compile(self.definition.get('condition'),
-                            '<condition_expression>',
-                            'eval')
+        self._condition = compile(self.definition.get('condition'),
+                                  '<condition_expression>',
+                                  'eval')
       except TypeError as e:  # condition string contains null bytes.
         self._CompleteBreakpoint({
             'status': {
@@ -186,50 +270,83 @@ class PythonBreakpoint(object):
                     'parameters': [e.msg]}}})
         return False
 
+    # Breakpoints with a request tag only fire on threads that the
+    # application tagged with googleclouddebugger.SetRequestTag.
+    request_tag = self.definition.get('requestTag')
+    if request_tag is not None and not _IsValidRequestTag(request_tag):
+      self._CompleteBreakpoint({
+          'status': {
+              'isError': True,
+              'refersTo': 'BREAKPOINT_CONDITION',
+              'description': {'format': INVALID_REQUEST_TAG}}})
+      return False
+
+    return True
+
+  def Patch(self):
+    """Last activation stage: sets the breakpoint in the code object.
+
+    Returns:
+      True if the breakpoint was set or False if it has been completed in
+      the meantime.
+    """
+    if self._completed:
+      return False
+
+    if self._cookie is not None:
+      return True  # Already activated.
+
     line = self.definition['location']['line']
 
     native.LogInfo('Creating new Python breakpoint %s in %s, line %d' % (
-        self.GetBreakpointId(), code_object, line))
+        self.GetBreakpointId(), self._code_object, line))
 
     self._cookie = native.SetConditionalBreakpoint(
-        code_object,
+        self._code_object,
         line,
-        condition,
-        self._BreakpointEvent)
+        self._condition,
+        self._BreakpointEvent,
+        self.definition.get('requestTag'),
+        self.definition.get('userEmail'))
+
+    self._code_object = None
+    self._condition = None
+
+    if self._completed:
+      # The breakpoint was cleared by another thread (or by the error
+      # callback) before the cookie was stored.
+      self.Clear()
+      return False
 
     return True
 
-  def _FindCodeObject(self):
-    """Finds the target code object for the breakpoint.
+  def _TryActivateBreakpoint(self):
+    """Sets the breakpoint if the module has already been loaded.
 
-    This function completes breakpoint with error if the module was found,
-    but the line number is invalid. When code object is not found for the
-    breakpoint source location, this function just returns None. It does not
-    assume error, because it might be a deferred breakpoint.
+    Goes through all the activation stages at once. This function will
+    complete the breakpoint with error if breakpoint definition is incorrect.
+    Examples: invalid line or bad condition.
+
+    If the module corresponding to the source path hasn't been loaded, this
+    function returns False. In this case, the breakpoint is not completed,
+    since the breakpoint may be deferred.
 
     Returns:
-      Python code object object in which the breakpoint will be set or None if
-      module not found or if there is no code at the specified line.
+      True if breakpoint was set or false otherwise. False can be returned
+      for potentially deferred breakpoints or in case of a bad breakpoint
+      definition. The self._completed flag distinguishes between the two cases.
     """
-    path = self.definition['location']['path']
-    line = self.definition['location']['line']
-
-    module = module_lookup.FindModule(path)
+    module = module_lookup.FindModule(self.definition['location']['path'])
     if not module:
-      return None
+      return False
 
-    code_object = module_explorer.GetCodeObjectAtLine(module, line)
-    if code_object is None:
-      self._CompleteBreakpoint({
-          'status': {
-              'isError': True,
-              'refersTo': 'BREAKPOINT_SOURCE_LOCATION',
-              'description': {
-                  'format': NO_CODE_FOUND_AT_LINE,
-                  'parameters': [str(line)]}}})
-      return None
+    code_object = module_explorer.GetCodeObjectAtLine(
+        module,
+        self.definition['location']['line'])
 
-    return code_object
+    return (self.Resolve(module, code_object) and
+            self.Compile() and
+            self.Patch())
 
   # Enables deferred breakpoints.
   def _DeferBreakpoint(self):
@@ -262,6 +379,7 @@ class PythonBreakpoint(object):
               'isError': True,
               'refersTo': 'BREAKPOINT_SOURCE_LOCATION',
               'description': {'format': MODULE_NOT_FOUND}}})
+      return
 
     assert not self._import_hook_cleanup
     self._import_hook_cleanup = deferred_modules.AddImportCallback(
@@ -280,9 +398,23 @@ class PythonBreakpoint(object):
       data = dict(self.definition, **data)
     data['isFinalState'] = True
 
-    self._hub_client.EnqueueBreakpointUpdate(data)
-    self._breakpoints_manager.CompleteBreakpoint(self.GetBreakpointId())
-    self.Clear()
+    # The breakpoint must be deactivated even if the update can't be sent,
+    # otherwise it would keep firing on every hit.
+    try:
+      self._hub_client.EnqueueBreakpointUpdate(data)
+    except (TypeError, ValueError) as e:
+      native.LogWarning('Failed to serialize breakpoint %s update: %s' % (
+          self.GetBreakpointId(), e))
+      self._hub_client.EnqueueBreakpointUpdate(dict(
+          self.definition,
+          isFinalState=True,
+          status={
+              'isError': True,
+              'refersTo': 'UNSPECIFIED',
+              'description': {'format': SERIALIZATION_ERROR}}))
+    finally:
+      self._breakpoints_manager.CompleteBreakpoint(self.GetBreakpointId())
+      self.Clear()
 
   def _SetCompleted(self):
     """Atomically marks the breakpoint as completed.
@@ -309,7 +441,8 @@ class PythonBreakpoint(object):
     if event != native.BREAKPOINT_EVENT_HIT:
       error_status = _BREAKPOINT_EVENT_STATUS[event]
     elif self.definition.get('action') == 'LOG':
-      collector = capture_collector.LogCollector(self.definition)
+      collector = capture_collector.LogCollector(
+          self.definition, self._log_deduplicator)
       error_status = collector.Log(frame)
       if not error_status:
         return  # Log action successful, no need to clear the breakpoint.
@@ -328,3 +461,13 @@ class PythonBreakpoint(object):
     collector.Collect(frame)
 
     self._CompleteBreakpoint(collector.breakpoint, is_incremental=False)
+
+
+def _IsValidRequestTag(request_tag):
+  """Checks that the request tag is a string or a native integer."""
+  if isinstance(request_tag, basestring):
+    return True
+
+  return (isinstance(request_tag, (int, long)) and
+          not isinstance(request_tag, bool) and
+          -sys.maxint - 1 <= request_tag <= sys.maxint)
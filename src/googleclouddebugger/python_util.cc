@@ -191,6 +191,28 @@ Nullable<string> ClearPythonException() {
 }
 
 
+int64 GetShallowObjectSize(PyObject* obj) {
+  if (obj == nullptr) {
+    return 0;
+  }
+
+  PyTypeObject* type = Py_TYPE(obj);
+
+  int64 size = type->tp_basicsize;
+  if (type->tp_itemsize != 0) {
+    // The sign of "ob_size" encodes the sign of long integers.
+    Py_ssize_t items = Py_SIZE(obj);
+    size += ((items < 0) ? -items : items) * type->tp_itemsize;
+  }
+
+  if (PyObject_IS_GC(obj)) {
+    size += sizeof(PyGC_Head);
+  }
+
+  return size;
+}
+
+
 PyObject* GetDebugletModuleObject(const char* key) {
   PyObject* module_dict = PyModule_GetDict(GetDebugletModule());
   if (module_dict == nullptr) {
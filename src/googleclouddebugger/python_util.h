@@ -298,6 +298,11 @@ ScopedPyObject NewNativePythonObject() {
 // nullptr. Otherwise formats the exception to string.
 Nullable<string> ClearPythonException();
 
+// Gets the size of the object header and its inline items (like characters
+// of a string or items of a tuple). Storage allocated separately (like the
+// item array of a list) is not included. Returns 0 for nullptr.
+int64 GetShallowObjectSize(PyObject* obj);
+
 // Gets Python object from dictionary of a native module. Returns nullptr if not
 // found. In case of success returns borrowed reference.
 PyObject* GetDebugletModuleObject(const char* key);
@@ -19,6 +19,11 @@
 
 #include "rate_limit.h"
 
+#include <pthread.h>
+
+#include <algorithm>
+#include <map>
+
 DEFINE_int64(
     max_trace_rate,
     25000,
@@ -47,16 +52,105 @@ namespace cdbg {
 static const double kMaxTraceRateCapacityFactor = 10;
 static const double kConditionCostCapacityFactor = 0.1;
 
+// Fair shares of the condition quota (see "ConditionQuota") get the
+// corresponding part of the burst capacity, but no less than this part of the
+// global capacity. Otherwise moderately expensive conditions would always be
+// rejected once there are many breakpoints.
+static const int64 kMaxConditionBurstShares = 10;
+
 static std::unique_ptr<LeakyBucket> g_trace_quota;
 static std::unique_ptr<LeakyBucket> g_global_condition_quota;
 
+// Quotas of owners that have active breakpoints. Nodes remove themselves
+// from here when the last breakpoint of the owner is cleared. Never destroyed,
+// because breakpoints still set at exit are destroyed with other static
+// objects, in no particular order.
+static std::map<string, ConditionQuotaNode*>* const g_owner_condition_quotas =
+    new std::map<string, ConditionQuotaNode*>;
+
+// Incremented in a forked child process. Per breakpoint quotas created before
+// the fork are recreated on their next use (see "ConditionQuota").
+static int64 g_condition_quota_generation = 0;
+
+
+struct ConditionQuotaNode
+    : public std::enable_shared_from_this<ConditionQuotaNode> {
+  ConditionQuotaNode(std::shared_ptr<ConditionQuotaNode> parent, string name)
+      : parent(parent),
+        name(name),
+        quota_shares(0) {
+    GetSiblings()->insert(std::make_pair(this->name, this));
+  }
+
+  ~ConditionQuotaNode() {
+    GetSiblings()->erase(name);
+  }
+
+  std::map<string, ConditionQuotaNode*>* GetSiblings() {
+    return (parent == nullptr) ? g_owner_condition_quotas : &parent->children;
+  }
+
+  // Leaks the quota (see "ResetRateLimitInChildProcess"), so that it's
+  // recreated (full) on the next use.
+  void ResetInChildProcess() {
+    quota.release();
+    quota_shares = 0;
+  }
+
+  // Owner quota for module nodes or nullptr for owner nodes.
+  const std::shared_ptr<ConditionQuotaNode> parent;
+
+  // Owner or module identifier.
+  const string name;
+
+  // Quota of the owner or module and the number of shares of the global
+  // quota it was created for.
+  std::unique_ptr<LeakyBucket> quota;
+  int64 quota_shares;
+
+  // Module nodes of an owner node. Module nodes keep their owner node
+  // alive, but not the other way around.
+  std::map<string, ConditionQuotaNode*> children;
+};
+
 
 static int64 GetBaseConditionQuotaCapacity() {
   return FLAGS_max_condition_lines_rate * kConditionCostCapacityFactor;
 }
 
 
+// Recreates quota objects in a forked child process, so that the tokens
+// consumed by the parent process don't count against the child. The old
+// objects are intentionally leaked: their mutex might have been locked by a
+// thread that doesn't exist in the child process.
+static void ResetRateLimitInChildProcess() {
+  if (g_trace_quota == nullptr) {
+    return;  // Not initialized yet.
+  }
+
+  g_trace_quota.release();
+  g_global_condition_quota.release();
+
+  for (const auto& owner : *g_owner_condition_quotas) {
+    owner.second->ResetInChildProcess();
+    for (const auto& module : owner.second->children) {
+      module.second->ResetInChildProcess();
+    }
+  }
+
+  ++g_condition_quota_generation;
+
+  LazyInitializeRateLimit();
+}
+
+
 void LazyInitializeRateLimit() {
+  static bool fork_handler_registered = false;
+  if (!fork_handler_registered) {
+    pthread_atfork(nullptr, nullptr, ResetRateLimitInChildProcess);
+    fork_handler_registered = true;
+  }
+
   if (g_trace_quota == nullptr) {
     g_trace_quota.reset(new LeakyBucket(
         FLAGS_max_trace_rate * kMaxTraceRateCapacityFactor,
@@ -87,10 +181,112 @@ LeakyBucket* GetGlobalConditionQuota() {
 }
 
 
-std::unique_ptr<LeakyBucket> CreatePerBreakpointConditionQuota() {
-  return std::unique_ptr<LeakyBucket>(new LeakyBucket(
-      GetBaseConditionQuotaCapacity() / 2,
-      FLAGS_max_condition_lines_rate / 2));
+// Takes "tokens" from "quota" that gets "shares"-th part of the global
+// condition quota. When the number of shares changes, the quota is rescaled
+// to the new share keeping the fraction of the capacity it has filled, so
+// that changes in the number of breakpoints don't refill it.
+static bool RequestShareTokens(
+    std::unique_ptr<LeakyBucket>* quota,
+    int64* quota_shares,
+    int64 shares,
+    int64 tokens) {
+  if ((*quota == nullptr) || (*quota_shares != shares)) {
+    const int64 capacity = std::max(
+        GetBaseConditionQuotaCapacity() / shares,
+        GetBaseConditionQuotaCapacity() / kMaxConditionBurstShares);
+    const int64 fill_rate =
+        std::max<int64>(FLAGS_max_condition_lines_rate / shares, 1);
+
+    const double fill_ratio =
+        (*quota == nullptr) ? 1.0 : (*quota)->GetFillRatio();
+    quota->reset(new LeakyBucket(capacity, fill_rate, fill_ratio));
+    *quota_shares = shares;
+  }
+
+  return (*quota)->RequestTokens(tokens);
+}
+
+
+// Gets the existing node in "siblings" or creates a new one.
+static std::shared_ptr<ConditionQuotaNode> GetConditionQuotaNode(
+    std::shared_ptr<ConditionQuotaNode> parent,
+    const string& name) {
+  const std::map<string, ConditionQuotaNode*>& siblings =
+      (parent == nullptr) ? *g_owner_condition_quotas : parent->children;
+  auto it = siblings.find(name);
+  if (it != siblings.end()) {
+    return it->second->shared_from_this();
+  }
+
+  return std::make_shared<ConditionQuotaNode>(parent, name);
+}
+
+
+ConditionQuota::ConditionQuota(const string& owner, const string& module)
+    : module_quota_(GetConditionQuotaNode(
+          GetConditionQuotaNode(nullptr, owner),
+          module)),
+      breakpoint_quota_shares_(0),
+      breakpoint_quota_generation_(g_condition_quota_generation) {
+}
+
+
+bool ConditionQuota::RequestTokens(
+    int64 tokens,
+    ConditionQuotaLevel* exceeded_level) {
+  ConditionQuotaNode* owner_quota = module_quota_->parent.get();
+
+  // Number of equal shares the global quota is split into at each level. A
+  // single breakpoint gets at most half of the quota of its module.
+  const int64 owner_shares = g_owner_condition_quotas->size();
+  const int64 module_shares = owner_shares * owner_quota->children.size();
+  const int64 breakpoint_shares = module_shares * 2;
+
+  // Leak the quota created by the parent process (see
+  // "ResetRateLimitInChildProcess").
+  if (breakpoint_quota_generation_ != g_condition_quota_generation) {
+    breakpoint_quota_.release();
+    breakpoint_quota_shares_ = 0;
+    breakpoint_quota_generation_ = g_condition_quota_generation;
+  }
+
+  // Levels are charged bottom up, so that the rejection is attributed to the
+  // most specific level that exceeded its share.
+  if (!RequestShareTokens(
+          &breakpoint_quota_,
+          &breakpoint_quota_shares_,
+          breakpoint_shares,
+          tokens)) {
+    *exceeded_level = ConditionQuotaLevel::Breakpoint;
+    return false;
+  }
+
+  if ((module_shares > owner_shares) &&
+      !RequestShareTokens(
+          &module_quota_->quota,
+          &module_quota_->quota_shares,
+          module_shares,
+          tokens)) {
+    *exceeded_level = ConditionQuotaLevel::Module;
+    return false;
+  }
+
+  if ((owner_shares > 1) &&
+      !RequestShareTokens(
+          &owner_quota->quota,
+          &owner_quota->quota_shares,
+          owner_shares,
+          tokens)) {
+    *exceeded_level = ConditionQuotaLevel::Owner;
+    return false;
+  }
+
+  if (!GetGlobalConditionQuota()->RequestTokens(tokens)) {
+    *exceeded_level = ConditionQuotaLevel::Global;
+    return false;
+  }
+
+  return true;
 }
 
 }  // namespace cdbg
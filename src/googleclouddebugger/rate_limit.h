@@ -24,7 +24,8 @@
 namespace devtools {
 namespace cdbg {
 
-// Initializes quota objects if not initialized yet.
+// Initializes quota objects if not initialized yet. Quota objects are
+// recreated in child processes after fork.
 void LazyInitializeRateLimit();
 
 // Release quota objects.
@@ -44,22 +45,80 @@ LeakyBucket* GetTraceQuota();
 
 // Condition and dynamic logging rate limits are defined as the maximum
 // number of lines of Python code per second to execute. These rate are enforced
-// as following:
-// 1. If a single breakpoint contributes to half the maximum rate, that
-//    breakpoint will be deactivated.
-// 2. If all breakpoints combined hit the maximum rate, any breakpoint to
+// by a hierarchy of quotas (see "ConditionQuota"):
+// 1. If a single breakpoint contributes to half of its share of the maximum
+//    rate, that breakpoint will be deactivated.
+// 2. If breakpoints in one module (or of one owner) exceed the share of that
+//    module (or owner), the breakpoint to exceed the limit gets disabled.
+// 3. If all breakpoints combined hit the maximum rate, any breakpoint to
 //    exceed the limit gets disabled.
 //
 // The first rule ensures that in vast majority of scenarios expensive
-// breakpoints will get deactivated. The second rule guarantees that in edge
-// case scenarios the total amount of time spent in condition evaluation will
-// not exceed the alotted limit.
+// breakpoints will get deactivated. The second rule keeps one user with many
+// expensive conditions from starving breakpoints of other users. The third
+// rule guarantees that in edge case scenarios the total amount of time spent
+// in condition evaluation will not exceed the alotted limit.
 //
 // While the actual cost of Python lines is not uniform, we only care about the
 // average. All limits ignore the number of CPUs since Python is inherently
 // single threaded.
 LeakyBucket* GetGlobalConditionQuota();
-std::unique_ptr<LeakyBucket> CreatePerBreakpointConditionQuota();
+
+// Level of the condition quota hierarchy.
+enum class ConditionQuotaLevel {
+  Global,
+  Owner,
+  Module,
+  Breakpoint
+};
+
+// Node of the condition quota hierarchy shared by the breakpoints of the
+// same owner (or of the same module of that owner).
+struct ConditionQuotaNode;
+
+// Quota on cost of evaluating condition of a single breakpoint. The quota of
+// the breakpoint is nested in the quota of its module (source file), which is
+// nested in the quota of the breakpoint owner (the user that set it), which
+// is nested in the global quota.
+//
+// Each level gets a fair share of its parent: the rate and the burst capacity
+// of the parent divided equally among the children that currently have active
+// breakpoints. A single breakpoint never gets more than half of the quota of
+// its module. Levels with a single child have the same share as their parent
+// and are not tracked separately, so breakpoints of a single owner in a single
+// module are only limited by the per breakpoint and the global quotas. The
+// burst capacity of a share has a lower bound, so that moderately expensive
+// conditions remain possible with many breakpoints. When its share changes, a
+// quota is rescaled keeping the filled fraction of its capacity.
+//
+// All functions must be called with Interpreter Lock held.
+class ConditionQuota {
+ public:
+  // Registers the breakpoint in the hierarchy. "owner" and "module" are
+  // arbitrary identifiers (empty strings are valid).
+  ConditionQuota(const string& owner, const string& module);
+
+  // Takes "tokens" from the quotas at all levels starting from the
+  // breakpoint. Returns true if all levels had enough tokens. Otherwise sets
+  // "exceeded_level" to the level whose quota was exceeded. The quotas of the
+  // levels above it are not charged in this case.
+  bool RequestTokens(int64 tokens, ConditionQuotaLevel* exceeded_level);
+
+ private:
+  // Quota of the module of the breakpoint within its owner.
+  std::shared_ptr<ConditionQuotaNode> module_quota_;
+
+  // Quota of this breakpoint and the number of shares of the global rate it
+  // was created for.
+  std::unique_ptr<LeakyBucket> breakpoint_quota_;
+  int64 breakpoint_quota_shares_;
+
+  // Value of the fork counter when "breakpoint_quota_" was created. The
+  // quota is recreated in a forked child process.
+  int64 breakpoint_quota_generation_;
+
+  DISALLOW_COPY_AND_ASSIGN(ConditionQuota);
+};
 
 }  // namespace cdbg
 }  // namespace devtools
@@ -0,0 +1,94 @@
+/**
+ * Copyright 2015 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Ensure that Python.h is included before any other header.
+#include "common.h"
+
+#include "request_tag.h"
+
+namespace devtools {
+namespace cdbg {
+
+// Canonical tag of the current thread or nullptr if the thread is untagged.
+// Owns the reference.
+static thread_local PyObject* g_request_tag = nullptr;
+
+
+ScopedPyObject NormalizeRequestTag(PyObject* tag) {
+  if (PyString_Check(tag)) {
+    PyObject* str = tag;
+    Py_INCREF(str);
+    PyString_InternInPlace(&str);
+    return ScopedPyObject(str);
+  }
+
+  if (PyUnicode_Check(tag)) {
+    PyObject* str = PyUnicode_AsUTF8String(tag);
+    if (str == nullptr) {
+      return ScopedPyObject();
+    }
+
+    PyString_InternInPlace(&str);
+    return ScopedPyObject(str);
+  }
+
+  if (PyInt_Check(tag) || PyLong_Check(tag)) {
+    const long value = PyInt_AsLong(tag);  // NOLINT
+    if ((value == -1) && PyErr_Occurred()) {
+      return ScopedPyObject();
+    }
+
+    return ScopedPyObject(PyInt_FromLong(value));
+  }
+
+  PyErr_SetString(PyExc_TypeError, "request tag must be a string or integer");
+  return ScopedPyObject();
+}
+
+
+bool SetRequestTag(PyObject* tag) {
+  ScopedPyObject canonical_tag;
+  if (tag != Py_None) {
+    canonical_tag = NormalizeRequestTag(tag);
+    if (canonical_tag == nullptr) {
+      return false;
+    }
+  }
+
+  // Releasing the previous tag can't run any Python code (it is either str
+  // or int), so it's safe to do it after the variable is updated.
+  PyObject* previous_tag = g_request_tag;
+  g_request_tag = canonical_tag.release();
+  Py_XDECREF(previous_tag);
+
+  return true;
+}
+
+
+bool IsCurrentRequestTag(PyObject* tag) {
+  PyObject* current_tag = g_request_tag;
+  if (current_tag == tag) {
+    return true;  // Interned strings (and small integers).
+  }
+
+  return (current_tag != nullptr) &&
+         PyInt_CheckExact(current_tag) &&
+         PyInt_CheckExact(tag) &&
+         (PyInt_AS_LONG(current_tag) == PyInt_AS_LONG(tag));
+}
+
+}  // namespace cdbg
+}  // namespace devtools
@@ -0,0 +1,56 @@
+/**
+ * Copyright 2015 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DEVTOOLS_CDBG_DEBUGLETS_PYTHON_REQUEST_TAG_H_
+#define DEVTOOLS_CDBG_DEBUGLETS_PYTHON_REQUEST_TAG_H_
+
+#include "common.h"
+#include "python_util.h"
+
+namespace devtools {
+namespace cdbg {
+
+// Request tags let a breakpoint fire only for selected requests (for example
+// requests of a single customer or with a specific trace ID). The application
+// sets the tag of the current thread when it starts handling a request. A
+// breakpoint with a tag only fires on threads with the same tag. The check
+// is a pointer or integer comparison done before the condition is evaluated,
+// so untagged traffic doesn't pay for the condition.
+//
+// Tags are either strings (str or unicode, stored as interned UTF-8 str) or
+// integers.
+//
+// All functions must be called with Interpreter Lock held.
+
+// Converts the tag into its canonical form: interned str or int. Returns
+// nullptr and sets Python exception if "tag" is of unsupported type.
+ScopedPyObject NormalizeRequestTag(PyObject* tag);
+
+// Sets the tag of the current thread. "tag" of None clears the tag. Returns
+// false and sets Python exception if "tag" is of unsupported type.
+//
+// The tag is stored in a native thread local variable. A thread that exits
+// with a tag set leaks the reference to its tag.
+bool SetRequestTag(PyObject* tag);
+
+// Returns true if the tag of the current thread is equal to "tag", which
+// must be in the canonical form (see "NormalizeRequestTag").
+bool IsCurrentRequestTag(PyObject* tag);
+
+}  // namespace cdbg
+}  // namespace devtools
+
+#endif  // DEVTOOLS_CDBG_DEBUGLETS_PYTHON_REQUEST_TAG_H_
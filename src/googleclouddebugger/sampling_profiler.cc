@@ -0,0 +1,309 @@
+/**
+ * Copyright 2015 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Ensure that Python.h is included before any other header.
+#include "common.h"
+
+#include "sampling_profiler.h"
+
+#include <pthread.h>
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>  // NOLINT
+
+DEFINE_int32(
+    profiler_max_nodes,
+    100000,
+    "maximum number of unique (code object, line) nodes in the stack trie "
+    "of the sampling profiler");
+
+namespace devtools {
+namespace cdbg {
+
+// Stacks deeper than this are truncated (keeping the innermost frames).
+static const int kMaxStackDepth = 128;
+
+
+SamplingProfiler::SamplingProfiler()
+    : stop_(false),
+      interval_ns_(0),
+      duration_ns_(0),
+      cpu_only_(true),
+      sample_count_(0) {
+}
+
+
+bool SamplingProfiler::Start(
+    int sampling_rate_hz,
+    double duration_sec,
+    bool cpu_only) {
+  if (thread_ != nullptr) {
+    return false;
+  }
+
+  Reset();
+
+  interval_ns_ = 1000000000LL / sampling_rate_hz;
+  duration_ns_ = static_cast<int64>(duration_sec * 1000000000LL);
+  cpu_only_ = cpu_only;
+  stop_ = false;
+
+  // The sampling thread acquires Interpreter Lock through PyGILState API.
+  PyEval_InitThreads();
+
+  thread_.reset(new std::thread(&SamplingProfiler::ThreadProc, this));
+
+  return true;
+}
+
+
+void SamplingProfiler::Stop(string* collapsed_stacks, int64* sample_count) {
+  collapsed_stacks->clear();
+  *sample_count = 0;
+
+  if (thread_ == nullptr) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    stop_ = true;
+  }
+  stop_event_.notify_all();
+
+  // The sampling thread might be waiting for Interpreter Lock.
+  Py_BEGIN_ALLOW_THREADS
+  thread_->join();
+  Py_END_ALLOW_THREADS
+
+  thread_ = nullptr;
+
+  string prefix;
+  FormatNode(0, &prefix, collapsed_stacks);
+  *sample_count = sample_count_;
+
+  Reset();
+}
+
+
+void SamplingProfiler::ThreadProc() {
+  const auto interval = std::chrono::nanoseconds(interval_ns_);
+  const auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::nanoseconds(duration_ns_);
+  auto next_tick = std::chrono::steady_clock::now();
+
+  std::unique_lock<std::mutex> lock(mu_);
+  while (true) {
+    // Skip ticks that were missed while waiting for Interpreter Lock rather
+    // than sampling in a burst.
+    next_tick = std::max(
+        next_tick + interval,
+        std::chrono::steady_clock::now());
+    if (next_tick > deadline) {
+      break;
+    }
+
+    if (stop_event_.wait_until(lock, next_tick, [this] { return stop_; })) {
+      break;
+    }
+
+    lock.unlock();
+
+    PyGILState_STATE state = PyGILState_Ensure();
+    Sample(PyThreadState_Get());
+    PyGILState_Release(state);
+
+    lock.lock();
+  }
+}
+
+
+void SamplingProfiler::Sample(PyThreadState* self) {
+  for (PyThreadState* thread_state =
+           PyInterpreterState_ThreadHead(self->interp);
+       thread_state != nullptr;
+       thread_state = PyThreadState_Next(thread_state)) {
+    if ((thread_state == self) || (thread_state->frame == nullptr)) {
+      continue;
+    }
+
+    const int64 samples = cpu_only_ ? GetCpuSamples(thread_state) : 1;
+    if (samples > 0) {
+      AddStack(thread_state->frame, samples);
+    }
+  }
+}
+
+
+void SamplingProfiler::AddStack(PyFrameObject* frame, int64 samples) {
+  PyFrameObject* stack[kMaxStackDepth];
+  int depth = 0;
+  while ((frame != nullptr) && (depth < kMaxStackDepth)) {
+    stack[depth++] = frame;
+    frame = frame->f_back;
+  }
+
+  if (nodes_.empty()) {
+    nodes_.push_back(Node());
+    nodes_[0].line = 0;
+    nodes_[0].samples = 0;
+  }
+
+  int node = 0;
+  while (depth > 0) {
+    PyFrameObject* current = stack[--depth];
+    const int child = GetChild(
+        node,
+        current->f_code,
+        PyFrame_GetLineNumber(current));
+    if (child == -1) {
+      break;  // Trie is full, attribute the sample to the outer frame.
+    }
+
+    node = child;
+  }
+
+  nodes_[node].samples += samples;
+  sample_count_ += samples;
+}
+
+
+int SamplingProfiler::GetChild(int parent, PyCodeObject* code, int line) {
+  const auto key = std::make_pair(code, line);
+  auto it = nodes_[parent].children.find(key);
+  if (it != nodes_[parent].children.end()) {
+    return it->second;
+  }
+
+  if (nodes_.size() >= static_cast<size_t>(FLAGS_profiler_max_nodes)) {
+    return -1;
+  }
+
+  const int child = nodes_.size();
+
+  // The trie keeps a reference to the code object, so that the pointer in
+  // the key doesn't get reused by another code object.
+  Node node;
+  node.code = ScopedPyCodeObject::NewReference(code);
+  node.line = line;
+  node.samples = 0;
+  nodes_.push_back(node);
+
+  nodes_[parent].children[key] = child;
+
+  return child;
+}
+
+
+void SamplingProfiler::FormatNode(
+    int node,
+    string* prefix,
+    string* output) const {
+  if (node >= static_cast<int>(nodes_.size())) {
+    return;  // Empty trie.
+  }
+
+  const size_t prefix_size = prefix->size();
+
+  if (node != 0) {
+    PyCodeObject* code = nodes_[node].code.get();
+    if (!prefix->empty()) {
+      prefix->push_back(';');
+    }
+
+    *prefix += PyString_AsString(code->co_name);
+    *prefix += " (";
+    *prefix += PyString_AsString(code->co_filename);
+    *prefix += ':';
+    *prefix += std::to_string(nodes_[node].line);
+    *prefix += ')';
+
+    if (nodes_[node].samples > 0) {
+      *output += *prefix;
+      *output += ' ';
+      *output += std::to_string(nodes_[node].samples);
+      *output += '\n';
+    }
+  }
+
+  for (const auto& child : nodes_[node].children) {
+    FormatNode(child.second, prefix, output);
+  }
+
+  prefix->resize(prefix_size);
+}
+
+
+int64 SamplingProfiler::GetCpuSamples(PyThreadState* thread_state) {
+  clockid_t clock_id;
+  if (pthread_getcpuclockid(
+          static_cast<pthread_t>(thread_state->thread_id),
+          &clock_id) != 0) {
+    return 1;  // Can't tell, count the sample.
+  }
+
+  timespec cpu_time;
+  if (clock_gettime(clock_id, &cpu_time) != 0) {
+    return 1;
+  }
+
+  const int64 cpu_ns = cpu_time.tv_sec * 1000000000LL + cpu_time.tv_nsec;
+
+  auto it = thread_cpu_time_.find(thread_state->thread_id);
+  if (it == thread_cpu_time_.end()) {
+    // First tick only establishes the baseline.
+    thread_cpu_time_[thread_state->thread_id] = { cpu_ns, 0 };
+    return 0;
+  }
+
+  ThreadCpuTime& thread_cpu_time = it->second;
+  thread_cpu_time.credit_ns += cpu_ns - thread_cpu_time.last_cpu_ns;
+  thread_cpu_time.last_cpu_ns = cpu_ns;
+
+  const int64 samples = thread_cpu_time.credit_ns / interval_ns_;
+  thread_cpu_time.credit_ns -= samples * interval_ns_;
+
+  return samples;
+}
+
+
+int64 SamplingProfiler::GetMemoryUsage() const {
+  // Each map node has three pointers and color in addition to the value.
+  const int64 kMapNodeOverhead = 4 * sizeof(void*);
+
+  int64 size = nodes_.capacity() * sizeof(Node);
+  for (const Node& node : nodes_) {
+    size += node.children.size() *
+            (sizeof(std::pair<std::pair<PyCodeObject*, int>, int>) +
+             kMapNodeOverhead);
+  }
+
+  size += thread_cpu_time_.size() *
+          (sizeof(std::pair<long, ThreadCpuTime>) + sizeof(void*));  // NOLINT
+
+  return size;
+}
+
+
+void SamplingProfiler::Reset() {
+  nodes_.clear();
+  sample_count_ = 0;
+  thread_cpu_time_.clear();
+}
+
+}  // namespace cdbg
+}  // namespace devtools
@@ -0,0 +1,141 @@
+/**
+ * Copyright 2015 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DEVTOOLS_CDBG_DEBUGLETS_PYTHON_SAMPLING_PROFILER_H_
+#define DEVTOOLS_CDBG_DEBUGLETS_PYTHON_SAMPLING_PROFILER_H_
+
+#include <condition_variable>  // NOLINT
+#include <map>
+#include <mutex>  // NOLINT
+#include <thread>  // NOLINT
+#include <unordered_map>
+#include <vector>
+#include "common.h"
+#include "python_util.h"
+
+namespace devtools {
+namespace cdbg {
+
+// Periodically samples call stacks of all Python threads.
+//
+// Sampling runs on a native thread. On each tick the thread acquires the
+// Interpreter Lock, walks the frames of every thread state and folds the
+// stacks into a trie keyed by code object and line number. Each trie node
+// counts the samples in which it was the innermost frame.
+//
+// In the CPU mode each thread accumulates the CPU time it consumed and is
+// sampled once per sampling interval worth of CPU time. Threads blocked on
+// I/O or locks are therefore not counted, and a thread that only runs a
+// fraction of the time gets the same fraction of samples. In the wall clock
+// mode all threads are sampled on every tick.
+//
+// The profiler stops by itself once the requested duration elapses. The
+// results are kept until "Stop" is called.
+class SamplingProfiler {
+ public:
+  SamplingProfiler();
+
+  // Starts the sampling thread. Returns false if the profiler is already
+  // running. Must be called with Interpreter Lock held.
+  bool Start(int sampling_rate_hz, double duration_sec, bool cpu_only);
+
+  // Stops the sampling thread (if still running) and formats the collected
+  // stacks in the collapsed stack format (one "frame;frame;...;frame count"
+  // line per unique stack, outermost frame first). Must be called with
+  // Interpreter Lock held. Releases it while waiting for the thread to exit.
+  void Stop(string* collapsed_stacks, int64* sample_count);
+
+  // Returns true between "Start" and "Stop".
+  bool is_started() const { return thread_ != nullptr; }
+
+  // Approximates the memory used by the collected stacks. Must be called
+  // with Interpreter Lock held.
+  int64 GetMemoryUsage() const;
+
+ private:
+  // Node of the stack trie. The root node has no code object.
+  struct Node {
+    ScopedPyCodeObject code;
+    int line;
+    int64 samples;
+    std::map<std::pair<PyCodeObject*, int>, int> children;
+  };
+
+  // Entry point of the sampling thread.
+  void ThreadProc();
+
+  // Samples all the Python threads. Must be called with Interpreter Lock
+  // held.
+  void Sample(PyThreadState* self);
+
+  // Adds a single stack to the trie with the specified number of samples.
+  void AddStack(PyFrameObject* frame, int64 samples);
+
+  // Returns the index of the child node, creating it if necessary.
+  int GetChild(int parent, PyCodeObject* code, int line);
+
+  // Appends collapsed stacks of the subtree. "prefix" is the path to "node".
+  void FormatNode(int node, string* prefix, string* output) const;
+
+  // Returns the number of samples to attribute to the current stack of the
+  // thread based on the CPU time it consumed since the previous tick.
+  int64 GetCpuSamples(PyThreadState* thread_state);
+
+  // Releases all the references to code objects. Must be called with
+  // Interpreter Lock held.
+  void Reset();
+
+ private:
+  // Sampling thread (nullptr if not started).
+  std::unique_ptr<std::thread> thread_;
+
+  // Protects "stop_".
+  std::mutex mu_;
+
+  // Signalled to stop the sampling thread early.
+  std::condition_variable stop_event_;
+  bool stop_;
+
+  // Sampling configuration.
+  int64 interval_ns_;
+  int64 duration_ns_;
+  bool cpu_only_;
+
+  // Stack trie. Only accessed with Interpreter Lock held.
+  std::vector<Node> nodes_;
+
+  // Total number of stacks added to the trie.
+  int64 sample_count_;
+
+  // CPU time accounting of a single thread.
+  struct ThreadCpuTime {
+    // Thread CPU clock at the previous tick.
+    int64 last_cpu_ns;
+
+    // CPU time not yet converted into samples.
+    int64 credit_ns;
+  };
+
+  // CPU time accounting of each thread keyed by thread ID.
+  std::unordered_map<long, ThreadCpuTime> thread_cpu_time_;  // NOLINT
+
+  DISALLOW_COPY_AND_ASSIGN(SamplingProfiler);
+};
+
+}  // namespace cdbg
+}  // namespace devtools
+
+#endif  // DEVTOOLS_CDBG_DEBUGLETS_PYTHON_SAMPLING_PROFILER_H_
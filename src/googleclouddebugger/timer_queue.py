@@ -0,0 +1,137 @@
+# Copyright 2015 Google Inc. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS-IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Min-heap of timers ordered by due time."""
+
+import heapq
+import itertools
+from threading import Lock
+
+
+class Timer(object):
+  """Handle of a scheduled callback."""
+
+  def __init__(self, due_time, callback, period):
+    self.due_time = due_time
+    self.callback = callback
+    self.period = period
+    self.cancelled = False
+
+
+class TimerQueue(object):
+  """Schedules one shot and periodic callbacks.
+
+  The queue doesn't have its own thread. The owner calls PopExpired
+  periodically and invokes the returned callbacks. Time values are opaque to
+  this class: they can be datetime objects (with timedelta periods) or
+  numbers, as long as the same type is used consistently.
+
+  Scheduling and cancellation are O(log n). Cancelled timers stay in the heap
+  until they reach the top (or until they make up half of the heap), so
+  PopExpired only does work proportional to the number of expired and
+  cancelled timers.
+
+  This class is thread safe.
+  """
+
+  def __init__(self):
+    self._lock = Lock()
+    self._heap = []
+    self._sequence = itertools.count()  # Tie breaker for equal due times.
+    self._cancelled_count = 0
+
+  def AfterFork(self):
+    """Reinitializes the lock in a forked child process."""
+    self._lock = Lock()
+
+  def __len__(self):
+    """Returns the number of scheduled timers that weren't cancelled."""
+    return len(self._heap) - self._cancelled_count
+
+  def Schedule(self, due_time, callback, period=None):
+    """Schedules a callback.
+
+    Args:
+      due_time: time at which the callback should be invoked.
+      callback: callable to invoke (with no arguments).
+      period: if set, the timer is rescheduled at "due_time + period" after
+          it expires.
+
+    Returns:
+      Timer object that can be passed to Cancel.
+    """
+    timer = Timer(due_time, callback, period)
+    with self._lock:
+      self._Push(timer)
+    return timer
+
+  def Cancel(self, timer):
+    """Cancels a scheduled timer. No-op if the timer already expired."""
+    with self._lock:
+      if timer.cancelled:
+        return
+
+      timer.cancelled = True
+      self._cancelled_count += 1
+
+      if self._cancelled_count > len(self._heap) / 2:
+        self._heap = [entry for entry in self._heap if not entry[2].cancelled]
+        heapq.heapify(self._heap)
+        self._cancelled_count = 0
+
+  def NextDueTime(self):
+    """Returns the due time of the earliest timer or None if empty."""
+    with self._lock:
+      self._DiscardCancelled()
+      return self._heap[0][0] if self._heap else None
+
+  def PopExpired(self, current_time):
+    """Removes expired timers and reschedules periodic ones.
+
+    Args:
+      current_time: timers due at or before this time are expired.
+
+    Returns:
+      List of callbacks of expired timers ordered by due time. The caller
+      invokes them outside of any locks.
+    """
+    callbacks = []
+    with self._lock:
+      while True:
+        self._DiscardCancelled()
+        if not self._heap or self._heap[0][0] > current_time:
+          break
+
+        unused_due_time, unused_sequence, timer = heapq.heappop(self._heap)
+        callbacks.append(timer.callback)
+
+        if timer.period is None:
+          timer.cancelled = True  # Makes further Cancel calls no-op.
+        else:
+          # Skip missed periods rather than firing a burst of callbacks.
+          timer.due_time += timer.period
+          if timer.due_time <= current_time:
+            timer.due_time = current_time + timer.period
+          self._Push(timer)
+
+    return callbacks
+
+  def _Push(self, timer):
+    heapq.heappush(
+        self._heap, (timer.due_time, next(self._sequence), timer))
+
+  def _DiscardCancelled(self):
+    while self._heap and self._heap[0][2].cancelled:
+      heapq.heappop(self._heap)
+      self._cancelled_count -= 1
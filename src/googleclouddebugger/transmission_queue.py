@@ -0,0 +1,187 @@
+# Copyright 2015 Google Inc. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS-IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Byte-budgeted priority queue of pending breakpoint updates."""
+
+from collections import deque
+from threading import Lock
+
+# Priority classes of breakpoint updates (lower value is sent first).
+PRIORITY_SNAPSHOT = 0  # Final state with captured data.
+PRIORITY_ERROR = 1  # Final state with error status (including expiration).
+PRIORITY_INTERIM = 2  # Non-final state.
+
+_PRIORITIES = (PRIORITY_SNAPSHOT, PRIORITY_ERROR, PRIORITY_INTERIM)
+
+# Default limit on the total size of all the queued updates.
+DEFAULT_MAX_BYTES = 4 * 1024 * 1024
+
+
+def GetPriority(breakpoint):
+  """Classifies breakpoint update into one of the priority classes."""
+  if not breakpoint.get('isFinalState'):
+    return PRIORITY_INTERIM
+
+  status = breakpoint.get('status')
+  if status and status.get('isError'):
+    return PRIORITY_ERROR
+
+  return PRIORITY_SNAPSHOT
+
+
+class TransmissionItem(object):
+  """Single pending breakpoint update.
+
+  Attributes:
+    breakpoint_id: ID of the updated breakpoint.
+    priority: one of the PRIORITY_XXX constants.
+    is_final: True if this update puts the breakpoint into a final state.
+    body: serialized request body.
+    retry_count: number of failed transmission attempts so far.
+  """
+
+  def __init__(self, breakpoint_id, priority, is_final, body, retry_count=0):
+    self.breakpoint_id = breakpoint_id
+    self.priority = priority
+    self.is_final = is_final
+    self.body = body
+    self.retry_count = retry_count
+    self.removed = False
+
+
+class TransmissionQueue(object):
+  """Queue of breakpoint updates ordered by priority class.
+
+  Updates are dequeued in priority order and in FIFO order within the same
+  priority class. A new update of a breakpoint supersedes the pending one,
+  unless the pending update is final and the new one isn't.
+
+  The total size of all the queued bodies is limited. When the limit is
+  exceeded, the newest updates of the lowest priority class are evicted
+  first. Evicted items are returned to the caller, which may spool them or
+  drop them.
+
+  This class is thread safe.
+  """
+
+  def __init__(self, max_bytes=DEFAULT_MAX_BYTES):
+    self.max_bytes = max_bytes
+
+    self._lock = Lock()
+    self._queues = dict((priority, deque()) for priority in _PRIORITIES)
+    self._pending = {}  # Maps breakpoint ID to the queued item.
+    self._total_bytes = 0
+
+  def __len__(self):
+    return len(self._pending)
+
+  def total_bytes(self):
+    """Returns the total size of all the queued bodies."""
+    return self._total_bytes
+
+  def Push(self, item):
+    """Adds the item to the end of its priority class.
+
+    Args:
+      item: TransmissionItem to queue.
+
+    Returns:
+      List of items that were evicted to stay within the byte budget. This
+      list may include the new item itself.
+    """
+    with self._lock:
+      existing = self._pending.get(item.breakpoint_id)
+      if existing is not None:
+        if existing.is_final and not item.is_final:
+          return []  # The final state update is more important.
+        self._Remove(existing)
+        existing.body = None  # Release memory of the superseded update.
+
+      return self._Append(item)
+
+  def Requeue(self, item):
+    """Returns the item to the queue after a failed transmission attempt.
+
+    The item is dropped if a newer update of the same breakpoint was queued
+    in the meantime.
+
+    Args:
+      item: TransmissionItem previously returned by Pop.
+
+    Returns:
+      List of items that were evicted to stay within the byte budget.
+    """
+    with self._lock:
+      if item.breakpoint_id in self._pending:
+        return []
+      return self._Append(item)
+
+  def Pop(self):
+    """Removes and returns the most important item or None if empty."""
+    with self._lock:
+      for priority in _PRIORITIES:
+        queue = self._queues[priority]
+        while queue:
+          item = queue.popleft()
+          if item.removed:
+            continue
+          del self._pending[item.breakpoint_id]
+          self._total_bytes -= len(item.body)
+          return item
+
+    return None
+
+  def EvictInterim(self):
+    """Evicts all the queued non-final updates regardless of the budget.
+
+    Returns:
+      List of evicted items.
+    """
+    with self._lock:
+      evicted = []
+      queue = self._queues[PRIORITY_INTERIM]
+      while queue:
+        item = queue.popleft()
+        if not item.removed:
+          self._Remove(item)
+          evicted.append(item)
+
+      return evicted
+
+  def _Append(self, item):
+    """Appends the item to its priority class and enforces the budget."""
+    self._queues[item.priority].append(item)
+    self._pending[item.breakpoint_id] = item
+    self._total_bytes += len(item.body)
+
+    return self._Evict()
+
+  def _Remove(self, item):
+    """Marks the item as removed. Removed items are skipped by Pop."""
+    item.removed = True
+    del self._pending[item.breakpoint_id]
+    self._total_bytes -= len(item.body)
+
+  def _Evict(self):
+    """Evicts items until the queue is within the byte budget."""
+    evicted = []
+    for priority in reversed(_PRIORITIES):
+      queue = self._queues[priority]
+      while queue and self._total_bytes > self.max_bytes:
+        item = queue.pop()
+        if not item.removed:
+          self._Remove(item)
+          evicted.append(item)
+
+    return evicted
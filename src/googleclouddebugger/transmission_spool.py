@@ -0,0 +1,220 @@
+# Copyright 2015 Google Inc. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS-IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Bounded on-disk spool of pending breakpoint updates."""
+
+import errno
+import fcntl
+import mmap
+import os
+import struct
+from threading import Lock
+import zlib
+
+import cdbg_native as native
+
+# Default maximum size of the spool file in bytes (including the header).
+DEFAULT_MAX_SIZE = 16 * 1024 * 1024
+
+# Identifies the file format. Files with a different magic are discarded.
+_MAGIC = 'CDBGSPL1'
+
+# Spool header: magic, read offset, write offset, number of records.
+_HEADER = struct.Struct('<8sQQQ')
+
+# Record header: payload length and CRC32 of the payload.
+_RECORD_HEADER = struct.Struct('<Ii')
+
+
+class TransmissionSpool(object):
+  """Append-only FIFO of serialized breakpoint updates backed by a file.
+
+  The spool is a memory mapped file of a fixed size. Records are appended at
+  the write offset and consumed from the read offset. When the spool is
+  drained, both offsets are reset to the beginning. When a new record doesn't
+  fit at the end, the unread records are moved to the beginning of the file
+  first. If the record still doesn't fit, it is rejected.
+
+  Since the read and write offsets are kept in the file header, records
+  written by a previous instance of the debugger survive restarts.
+
+  The file is locked exclusively for the lifetime of the object, so that two
+  processes configured with the same path don't corrupt each other's records.
+
+  This class is thread safe.
+  """
+
+  def __init__(self, path, max_size=DEFAULT_MAX_SIZE):
+    """Opens or creates the spool file.
+
+    Args:
+      path: path of the spool file.
+      max_size: maximum size of the spool file in bytes.
+
+    Raises:
+      ValueError: if max_size is too small to hold any records.
+      IOError: if the file can't be opened or is used by another process.
+    """
+    if max_size <= _HEADER.size + _RECORD_HEADER.size:
+      raise ValueError('Spool size %d is too small' % max_size)
+
+    self._lock = Lock()
+    self._max_size = max_size
+
+    # The file descriptor is kept open to hold the lock.
+    self._fd = os.open(path, os.O_RDWR | os.O_CREAT, 0600)
+    try:
+      try:
+        fcntl.flock(self._fd, fcntl.LOCK_EX | fcntl.LOCK_NB)
+      except IOError as e:
+        if e.errno in (errno.EAGAIN, errno.EACCES):
+          raise IOError(e.errno, 'Spool file is used by another process')
+        raise
+
+      if os.fstat(self._fd).st_size != max_size:
+        os.ftruncate(self._fd, max_size)
+      self._mmap = mmap.mmap(self._fd, max_size)
+    except BaseException:
+      os.close(self._fd)
+      raise
+
+    magic, self._read_offset, self._write_offset, self._count = (
+        _HEADER.unpack_from(self._mmap, 0))
+    if ((magic != _MAGIC) or
+        (self._read_offset < _HEADER.size) or
+        (self._read_offset > self._write_offset) or
+        (self._write_offset > max_size)):
+      self._Reset()
+    elif self._count:
+      native.LogInfo('Transmission spool %s has %d pending updates' % (
+          path, self._count))
+
+  def __len__(self):
+    """Returns the number of records in the spool."""
+    return self._count
+
+  def Close(self):
+    """Flushes the spool to disk, releases the mapping and the lock."""
+    with self._lock:
+      if self._mmap is not None:
+        self._mmap.flush()
+        self._mmap.close()
+        self._mmap = None
+        os.close(self._fd)
+
+  def DetachAfterFork(self):
+    """Releases the inherited mapping in a forked child process.
+
+    The lock is shared with the parent process, which keeps using the spool.
+    Closing the inherited file descriptor (rather than unlocking) leaves the
+    lock held by the parent.
+    """
+    if self._mmap is not None:
+      self._mmap.close()
+      self._mmap = None
+      os.close(self._fd)
+
+  def Append(self, data):
+    """Appends a serialized update to the end of the spool.
+
+    Args:
+      data: string to store.
+
+    Returns:
+      True if the record was stored or False if the spool is full.
+    """
+    record_size = _RECORD_HEADER.size + len(data)
+
+    with self._lock:
+      if self._write_offset + record_size > self._max_size:
+        self._Compact()
+        if self._write_offset + record_size > self._max_size:
+          return False
+
+      _RECORD_HEADER.pack_into(self._mmap, self._write_offset,
+                               len(data), zlib.crc32(data))
+      start = self._write_offset + _RECORD_HEADER.size
+      self._mmap[start:start + len(data)] = data
+
+      self._write_offset += record_size
+      self._count += 1
+      self._WriteHeader()
+
+    return True
+
+  def Peek(self):
+    """Reads the oldest record without removing it from the spool.
+
+    If the record is corrupted, the entire spool is discarded.
+
+    Returns:
+      Stored string or None if the spool is empty.
+    """
+    with self._lock:
+      if not self._count:
+        return None
+
+      length, crc = _RECORD_HEADER.unpack_from(self._mmap, self._read_offset)
+      start = self._read_offset + _RECORD_HEADER.size
+      if start + length > self._write_offset:
+        native.LogWarning('Transmission spool corrupted, discarding')
+        self._Reset()
+        return None
+
+      data = self._mmap[start:start + length]
+      if zlib.crc32(data) != crc:
+        native.LogWarning('Transmission spool record corrupted, discarding')
+        self._Reset()
+        return None
+
+      return data
+
+  def Pop(self):
+    """Removes the oldest record from the spool."""
+    with self._lock:
+      if not self._count:
+        return
+
+      length, unused_crc = _RECORD_HEADER.unpack_from(
+          self._mmap, self._read_offset)
+      self._read_offset += _RECORD_HEADER.size + length
+      self._count -= 1
+
+      if not self._count:
+        self._read_offset = _HEADER.size
+        self._write_offset = _HEADER.size
+
+      self._WriteHeader()
+
+  def _Compact(self):
+    """Moves unread records to the beginning of the spool."""
+    if self._read_offset == _HEADER.size:
+      return
+
+    size = self._write_offset - self._read_offset
+    self._mmap.move(_HEADER.size, self._read_offset, size)
+    self._read_offset = _HEADER.size
+    self._write_offset = _HEADER.size + size
+    self._WriteHeader()
+
+  def _Reset(self):
+    """Discards all the records."""
+    self._read_offset = _HEADER.size
+    self._write_offset = _HEADER.size
+    self._count = 0
+    self._WriteHeader()
+
+  def _WriteHeader(self):
+    _HEADER.pack_into(self._mmap, 0, _MAGIC, self._read_offset,
+                      self._write_offset, self._count)